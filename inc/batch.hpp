@@ -0,0 +1,9 @@
+#ifndef PNGSQ_BATCH_HPP
+#define PNGSQ_BATCH_HPP
+
+// Processes images from the command line without creating a window or an OpenGL context
+// Usage: pngsquish --in <files|dirs...> --out <dir> [--job <file>] [--threads <n>] [--page-threads <n>] [--inflight <n>]
+// Returns the process exit code
+int run_batch(int argc, char** argv);
+
+#endif // PNGSQ_BATCH_HPP
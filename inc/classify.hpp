@@ -0,0 +1,75 @@
+#ifndef PNGSQ_CLASSIFY_HPP
+#define PNGSQ_CLASSIFY_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "defs.hpp"
+#include "head.hpp"
+
+struct hsv to_hsv(unsigned char r, unsigned char g, unsigned char b);
+struct hsv hsv_diff(const struct hsv& x, const struct hsv& y);
+
+// Lookup table of which 24-bit colours are background for a given background colour and set of thresholds
+// Each colour is tested once, the first time it is looked up, and the result is cached in 2 bits (4 MiB in total)
+// Lookups may run on several threads at once; `compile` may not
+class bg_table {
+public:
+	static constexpr size_t colours = (size_t)1 << 24;
+protected:
+	std::unique_ptr<uint8_t[]> states;
+	std::vector<struct threshold> thrs;
+	struct rgb background;
+	struct hsv bg_hsv;
+	bool dark;
+public:
+	bg_table(void);
+
+	// Prepares the table for a background colour and set of thresholds (disabled thresholds are ignored)
+	// Cached results are kept if nothing changed since the last call
+	void compile(const std::vector<struct threshold>& thrs, const struct rgb& background, bool dark);
+
+	// Tests a colour against the thresholds without using the table
+	bool evaluate(const struct rgb& colour) const;
+	// Tests 8 colours at once with SIMD if available; bit `i` of the result is set if `colours[i]` is background
+	uint32_t evaluate8(struct rgb const* colours) const;
+
+	// Adds all colours in `pixels` that are not in the table yet, testing them 8 at a time
+	void resolve(struct rgb const* pixels, size_t count);
+
+	// Returns true if `colour` is part of the background
+	inline bool test(const struct rgb& colour);
+protected:
+	static constexpr uint_fast32_t key(const struct rgb& colour);
+	// Bit 0: known, bit 1: background
+	inline unsigned state(uint_fast32_t key) const;
+	inline void store(uint_fast32_t key, bool background);
+};
+
+constexpr uint_fast32_t bg_table::key(const struct rgb& colour) {
+	return ((uint_fast32_t)colour.r << 16) | ((uint_fast32_t)colour.g << 8) | colour.b;
+}
+
+inline unsigned bg_table::state(uint_fast32_t key) const {
+	return (std::atomic_ref<uint8_t>(this->states[key >> 2]).load(std::memory_order_relaxed) >> ((key & 3) * 2)) & 3;
+}
+
+// Both bits are set together, so other threads never see a colour as known before its result is stored
+inline void bg_table::store(uint_fast32_t key, bool background) {
+	std::atomic_ref<uint8_t>(this->states[key >> 2]).fetch_or((uint8_t)((1 | ((unsigned)background << 1)) << ((key & 3) * 2)), std::memory_order_relaxed);
+}
+
+inline bool bg_table::test(const struct rgb& colour) {
+	const uint_fast32_t k = key(colour);
+	const unsigned state = this->state(k);
+	if (state & 1)
+		return state >> 1;
+	const bool background = this->evaluate(colour);
+	this->store(k, background);
+	return background;
+}
+
+#endif // PNGSQ_CLASSIFY_HPP
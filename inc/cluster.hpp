@@ -0,0 +1,31 @@
+#ifndef PNGSQ_CLUSTER_HPP
+#define PNGSQ_CLUSTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "defs.hpp"
+#include "random.hpp"
+
+// Each point counts `weights[i]` times, or once if `weights` is null
+
+// Picks `k` (at most 16) initial centroids from `points` with k-means++
+void k_means_pp(struct rgb* centroids, int k, struct rgb const* points, uint32_t const* weights, size_t n, rand_gen& rng);
+
+// Picks `k` (at most 16) initial centroids from `points` with k-means|| (scalable k-means++), splitting the passes over
+// the points across `threads` threads
+// The result only depends on `rng`, not on the number of threads
+void k_means_par(struct rgb* centroids, int k, struct rgb const* points, uint32_t const* weights, size_t n, rand_gen& rng, int threads);
+
+// Refines `k` (at most 16) centroids for `points`, rounding them to whole colours after every iteration
+// Stops after `iters` iterations, once no point changes cluster, or once no centroid moves further than `tolerance`
+void k_means(struct rgb* centroids, int k, struct rgb const* points, uint32_t const* weights, size_t n, int iters, float tolerance);
+
+// Returns the inertia of `centroids`, i.e. the weighted sum of squared distances from each point to its nearest centroid
+uint64_t k_means_cost(struct rgb const* centroids, int k, struct rgb const* points, uint32_t const* weights, size_t n);
+
+// Finds the nearest of `k` (at most 16) `centroids` to each of `n` colours, the lowest one on ties, 8 at a time with
+// SIMD where available
+void nearest_centroids(struct rgb const* colours, size_t n, struct rgb const* centroids, int k, unsigned char* entries);
+
+#endif // PNGSQ_CLUSTER_HPP
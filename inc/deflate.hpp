@@ -0,0 +1,21 @@
+#ifndef PNGSQ_DEFLATE_HPP
+#define PNGSQ_DEFLATE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct libdeflate_compressor;
+
+// Compresses `size` bytes of `data` into a single zlib stream, in the manner of pigz
+// The input is cut into segments of `segment` bytes (0 for one per compressor) that are compressed independently on up
+// to `count` threads, each with its own compressor, and joined at byte boundaries with empty stored blocks (as if by a
+// sync flush); segments after the first lose the preceding 32 KiB as a dictionary, so smaller segments cost some ratio
+// Returns the stream in pieces, one per segment, that concatenate to the whole stream; empty if compression failed
+std::vector<std::vector<unsigned char>> zlib_compress_segments(unsigned char const* data, size_t size, size_t segment,
+	struct libdeflate_compressor* const* compressors, int count);
+
+// Returns the Adler-32 checksum of two pieces of data joined together, given the checksum of each and the length of the second
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t length);
+
+#endif // PNGSQ_DEFLATE_HPP
@@ -2,12 +2,11 @@
 #define PNGSQ_DEFS_HPP
 
 #include <cfloat>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <new>
 
-#include "glad/glad.h"
-
-#define PNGSQ_GLSL_VERSION_STRING "#version 140"
 #define PNGSQ_ERROR_STRING "pngsquish error: "
 
 struct rgb { unsigned char r, g, b; };
@@ -17,6 +16,13 @@ static constexpr bool operator==(const struct rgb& left, const struct rgb& right
 	return left.r == right.r && left.g == right.g && left.b == right.b;
 }
 
+// Returns the cell of `colour` in a grid with `bits` bits per channel, red being the most significant
+template<unsigned bits>
+static constexpr uint_fast32_t colour_bin(const struct rgb& colour) {
+	constexpr unsigned shift = 8 - bits;
+	return ((uint_fast32_t)(colour.r >> shift) << (2 * bits)) | ((uint_fast32_t)(colour.g >> shift) << bits) | (colour.b >> shift);
+}
+
 static inline struct rgb* bytes_to_rgb(unsigned char* bytes, size_t count = 1) {
 #ifdef _MSC_VER
 	static_assert(_MSVC_LANG >= 202002L);
@@ -32,32 +38,21 @@ static constexpr struct point invalid_point = { -FLT_MAX, 0 };
 // Represents a quadrilateral in normalized (on [0, 1]) coordinates
 struct quad { struct point p[4]; };
 
+// Number of 64-bit words in each row of a background mask
+static constexpr size_t mask_stride(int width) { return ((size_t)width + 63) / 64; }
+
 struct image {
 	unsigned char* data_orig;
 	unsigned char* data_dewarp;
-	unsigned char* data_output;
+	unsigned char* data_index; // Palette index of each output pixel
+	uint64_t* data_mask; // Background bitmask, `mask_stride(out_width)` words per row; padding bits are set
 	char* path;
 	int width, height;
 	int out_width, out_height;
 	int full_width, full_height;
 	struct rgb palette[16];
 	struct quad dewarp_src;
-	GLuint texture;
+	unsigned int texture; // OpenGL texture name, only used by the GUI
 };
 
-static inline GLuint create_texture(unsigned char const* data, int width, int height, bool alpha) {
-	GLint format = alpha ? GL_RGBA : GL_RGB;
-	GLuint tex = 0;
-	glGenTextures(1, &tex);
-	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	return tex;
-}
-
 #endif // PNGSQ_DEFS_HPP
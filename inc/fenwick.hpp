@@ -0,0 +1,74 @@
+#ifndef PNGSQ_FENWICK_HPP
+#define PNGSQ_FENWICK_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Fenwick tree (binary indexed tree) of `n` integer weights, from Fenwick (1994)
+// Supports changing a weight and picking an index in proportion to its weight, both in O(log n)
+class fenwick_tree {
+protected:
+	std::unique_ptr<uint64_t[]> nodes; // 1-based; node `i` holds the sum of the `i & -i` weights ending at `i`
+	size_t n;
+	uint64_t sum;
+public:
+	inline fenwick_tree(size_t n);
+
+	// Replaces every weight in O(n)
+	inline void assign(uint64_t const* weights);
+	inline void add(size_t index, uint64_t amount);
+	// `amount` must not exceed the weight at `index`
+	inline void subtract(size_t index, uint64_t amount);
+
+	// Returns the index at which the running sum of the weights first exceeds `x`, so that an index with zero weight
+	// is never returned; `x` must be less than `total()`
+	inline size_t find(uint64_t x) const;
+	inline uint64_t total(void) const;
+};
+
+inline fenwick_tree::fenwick_tree(size_t n) : nodes(new uint64_t[n + 1]()), n(n), sum(0) { }
+
+inline void fenwick_tree::assign(uint64_t const* weights) {
+	this->sum = 0;
+	for (size_t i = 1; i <= this->n; i++) {
+		this->nodes[i] = weights[i - 1];
+		this->sum += weights[i - 1];
+	}
+	// Each node passes its partial sum on to its parent
+	for (size_t i = 1; i <= this->n; i++) {
+		const size_t parent = i + (i & (0 - i));
+		if (parent <= this->n)
+			this->nodes[parent] += this->nodes[i];
+	}
+}
+
+inline void fenwick_tree::add(size_t index, uint64_t amount) {
+	this->sum += amount;
+	for (size_t i = index + 1; i <= this->n; i += i & (0 - i))
+		this->nodes[i] += amount;
+}
+
+inline void fenwick_tree::subtract(size_t index, uint64_t amount) {
+	this->sum -= amount;
+	for (size_t i = index + 1; i <= this->n; i += i & (0 - i))
+		this->nodes[i] -= amount;
+}
+
+inline size_t fenwick_tree::find(uint64_t x) const {
+	size_t index = 0;
+	for (size_t step = std::bit_floor(this->n); step != 0; step >>= 1) {
+		if (index + step <= this->n && this->nodes[index + step] <= x) {
+			index += step;
+			x -= this->nodes[index];
+		}
+	}
+	return index;
+}
+
+inline uint64_t fenwick_tree::total(void) const {
+	return this->sum;
+}
+
+#endif // PNGSQ_FENWICK_HPP
@@ -0,0 +1,25 @@
+#ifndef PNGSQ_GL_HPP
+#define PNGSQ_GL_HPP
+
+#include "glad/glad.h"
+
+#include "defs.hpp"
+
+#define PNGSQ_GLSL_VERSION_STRING "#version 140"
+
+static inline GLuint create_texture(unsigned char const* data, int width, int height, bool alpha) {
+	GLint format = alpha ? GL_RGBA : GL_RGB;
+	GLuint tex = 0;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+	return tex;
+}
+
+#endif // PNGSQ_GL_HPP
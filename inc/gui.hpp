@@ -2,7 +2,7 @@
 #define PNGSQ_GUI_HPP
 
 #define IMGUI_IMPL_OPENGL_LOADER_CUSTOM
-#include "glad/glad.h"
+#include "gl.hpp"
 #include "imgui/imgui.h"
 #include "imgui/backends/imgui_impl_glfw.h"
 #include "imgui/backends/imgui_impl_opengl3.h"
@@ -22,6 +22,9 @@ bool init_shaders_prev(void);
 void deinit_shaders_prev(void);
 
 void draw(struct image& preview, struct wndinfo& wnd);
+bool load_image_preview(struct image& img, char const* path, const struct config& cfg);
+// Frees an image along with its preview texture
+void free_image_preview(struct image& img);
 void window_preview(struct image& img, struct wndinfo& wnd, struct config& cfg);
 
 static inline void Tooltip(char const* text, char const* hover) {
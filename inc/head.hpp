@@ -2,23 +2,30 @@
 #define PNGSQ_HEAD_HPP
 
 #include <cmath>
+#include <cstdint>
 #include <vector>
 
-#include "glad/glad.h"
-
 #include "defs.hpp"
 
 struct config;
 struct threshold;
 struct libdeflate_compressor;
+class rand_gen;
 
 bool load_image(struct image& img, char const* path);
-bool load_image_preview(struct image& img, char const* path, const struct config& cfg);
 void free_image(struct image& img);
-bool write_image(const struct image& img, char const* path, struct libdeflate_compressor* compressor);
+bool alloc_output(struct image& img, bool dewarp = true);
+// `compressors` must hold one compressor for each of the `cfg.threads` threads, all at the same level
+bool write_image(const struct image& img, char const* path, struct libdeflate_compressor* const* compressors, const struct config& cfg);
 void make_background(struct image& img, const std::vector<struct threshold>& thrs, const struct config& cfg);
-void make_palette(struct image& img, const struct config& cfg);
+void make_palette(struct image& img, const struct config& cfg, rand_gen& rng);
+// Fills `sample` with `n` foreground pixels of `img` chosen uniformly at random without replacement, in one pass
+// `img` needs `data_dewarp` and `data_mask` with at least `n` foreground pixels
+void res_sample(struct rgb* sample, int n, const struct image& img, rand_gen& rng);
 void use_palette(struct image& img, const struct config& cfg);
+// Does the work of `warp_image`, `make_background` and `make_palette` in one pass over the output, without `data_dewarp`
+// The background and palette are estimated from every `cfg.fused`-th output pixel across and down first
+bool squish_fused(struct image& img, const std::vector<struct threshold>& thrs, const struct config& cfg, rand_gen& rng);
 
 #define PNGSQ_PREVIEW_NONE      0
 #define PNGSQ_PREVIEW_ORIGINAL  1
@@ -28,13 +35,32 @@ void use_palette(struct image& img, const struct config& cfg);
 #define PNGSQ_VAL_MODE_RANGE    0
 #define PNGSQ_VAL_MODE_COMPARE  1
 
+#define PNGSQ_CLUSTER_SAMPLE    0
+#define PNGSQ_CLUSTER_HISTOGRAM 1
+
+#define PNGSQ_SEED_PP           0
+#define PNGSQ_SEED_PARALLEL     1
+
+#define PNGSQ_FILTER_NONE       0
+#define PNGSQ_FILTER_HEURISTIC  1
+#define PNGSQ_FILTER_TRIAL      2
+
 #define PNGSQ_VERT_MOVE_NEAREST 0
 #define PNGSQ_VERT_MOVE_OLDEST  1
 #define PNGSQ_VERT_CLEAR_ALL    2
 
 struct config {
 	int width, height;
+	int cluster; // PNGSQ_CLUSTER_SAMPLE clusters `sampled` pixels, PNGSQ_CLUSTER_HISTOGRAM clusters every pixel by colour
+	int seeding; // PNGSQ_SEED_PP for k-means++, PNGSQ_SEED_PARALLEL for k-means||
+	int trials; // Independent seed-and-cluster runs, keeping the palette with the lowest inertia (at least 1)
 	int sampled, iters;
+	float tolerance; // k-means stops once no palette entry moves further than this
+	int threads; // 0 for one per hardware thread
+	int fused; // If positive, dewarp and quantize in one pass with `squish_fused`, probing every `fused`-th pixel
+	int segment; // KiB of filtered rows deflated independently on each thread; 0 for one segment per thread
+	int filter; // PNG row filters: PNGSQ_FILTER_NONE, or chosen per row by PNGSQ_FILTER_HEURISTIC or PNGSQ_FILTER_TRIAL
+	uint64_t seed; // Seeds the random number generator; 0 for a new seed from std::random_device every run
 	bool dark, auto_palette;
 	bool ovr_bg_before, ovr_bg_after;
 	struct rgb ovr_bg_before_col, ovr_bg_after_col;
@@ -51,7 +77,7 @@ struct threshold {
 };
 
 static inline float calc_prev_scale(int width, int height, int kb) {
-	return std::sqrtf(kb / (0.02f * width * height));
+	return std::sqrt(kb / (0.02f * width * height));
 }
 
 #endif // PNGSQ_HEAD_HPP
@@ -0,0 +1,49 @@
+#ifndef PNGSQ_HISTOGRAM_HPP
+#define PNGSQ_HISTOGRAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "defs.hpp"
+
+// Dense colour histogram with 5 bits per channel (32768 bins), small enough to stay in cache
+class histogram {
+public:
+	static constexpr unsigned bits = 5;
+	static constexpr size_t bins = (size_t)1 << (3 * bits);
+protected:
+	std::unique_ptr<uint32_t[]> counts;
+public:
+	inline histogram(void);
+
+	// Returns the bin that `colour` is counted in
+	static constexpr uint_fast32_t bin(const struct rgb& colour);
+
+	void add(struct rgb const* pixels, size_t count);
+	void merge(const histogram& other);
+	void clear(void);
+
+	// Returns the exact most common colour, refining the fullest bins with further passes over `pixels`
+	// `pixels` must be the same pixels that were added; the passes are split across `threads` threads
+	struct rgb mode(struct rgb const* pixels, size_t count, int threads = 1) const;
+
+	inline uint32_t const* data(void) const;
+	inline uint32_t operator[](size_t bin) const;
+};
+
+inline histogram::histogram(void) : counts(new uint32_t[bins]()) { }
+
+constexpr uint_fast32_t histogram::bin(const struct rgb& colour) {
+	return colour_bin<bits>(colour);
+}
+
+inline uint32_t const* histogram::data(void) const {
+	return this->counts.get();
+}
+
+inline uint32_t histogram::operator[](size_t bin) const {
+	return this->counts[bin];
+}
+
+#endif // PNGSQ_HISTOGRAM_HPP
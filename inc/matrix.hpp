@@ -114,7 +114,7 @@ static inline mat<R1, C2, _T> operator*(const mat<R1, C1, _T>& left, const mat<R
 template <typename _T>
 static inline _T det(const mat<3, 3, _T>& m) {
 	return m(1, 1) * m(2, 2) * m(3, 3) + m(1, 2) * m(2, 3) * m(3, 1) + m(1, 3) * m(2, 1) * m(3, 2)
-		- m(1, 1) * m(2, 3) * m(3, 2) - m(1, 2) * m(2, 1) * m(3, 3) - m(1, 3) * m(2, 2) * m(1, 3);
+		- m(1, 1) * m(2, 3) * m(3, 2) - m(1, 2) * m(2, 1) * m(3, 3) - m(1, 3) * m(2, 2) * m(3, 1);
 }
 
 template <typename _T>
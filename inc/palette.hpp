@@ -0,0 +1,72 @@
+#ifndef PNGSQ_PALETTE_HPP
+#define PNGSQ_PALETTE_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "defs.hpp"
+
+// Nearest-entry lookup for a 16-colour palette
+// Colours are split into a 32x32x32 grid; each cell stores the set of entries that can be nearest to some colour in it
+// (64 KiB in total), so most lookups are a single load and the rest only compare against a few entries
+class palette_map {
+public:
+	static constexpr int bits = 5;
+	static constexpr size_t cells = (size_t)1 << (3 * bits);
+protected:
+	std::unique_ptr<uint16_t[]> candidates;
+	struct rgb palette[16];
+	bool built;
+public:
+	palette_map(void);
+
+	// Prepares the cells for `palette`; nothing is rebuilt if it is the same palette as last time
+	void build(struct rgb const* palette);
+
+	// Returns the index of the entry nearest to `colour`, the lowest one if several are equally near
+	inline unsigned char nearest(const struct rgb& colour) const;
+	// Returns the same as `nearest` if that is the only entry that can be nearest to colours in the cell of `colour`,
+	// otherwise -1
+	inline int unique(const struct rgb& colour) const;
+	// Returns the same as `nearest` by comparing against all entries
+	unsigned char evaluate(const struct rgb& colour) const;
+protected:
+	static constexpr uint_fast32_t cell(const struct rgb& colour);
+	static constexpr int dist2(const struct rgb& left, const struct rgb& right);
+};
+
+constexpr uint_fast32_t palette_map::cell(const struct rgb& colour) {
+	return colour_bin<bits>(colour);
+}
+
+constexpr int palette_map::dist2(const struct rgb& left, const struct rgb& right) {
+	const int dr = left.r - right.r, dg = left.g - right.g, db = left.b - right.b;
+	return dr * dr + dg * dg + db * db;
+}
+
+inline unsigned char palette_map::nearest(const struct rgb& colour) const {
+	uint_fast32_t set = this->candidates[cell(colour)];
+	unsigned char result = (unsigned char)std::countr_zero(set);
+	if ((set &= set - 1) == 0)
+		return result;
+	// Candidates are compared in index order, so ties go to the lowest index
+	int best = dist2(colour, this->palette[result]);
+	for (; set != 0; set &= set - 1) {
+		const int entry = std::countr_zero(set);
+		const int dist = dist2(colour, this->palette[entry]);
+		if (best > dist) {
+			best = dist;
+			result = (unsigned char)entry;
+		}
+	}
+	return result;
+}
+
+inline int palette_map::unique(const struct rgb& colour) const {
+	const uint_fast32_t set = this->candidates[cell(colour)];
+	return (set & (set - 1)) == 0 ? std::countr_zero(set) : -1;
+}
+
+#endif // PNGSQ_PALETTE_HPP
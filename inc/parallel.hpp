@@ -0,0 +1,32 @@
+#ifndef PNGSQ_PARALLEL_HPP
+#define PNGSQ_PARALLEL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Returns `requested` if it is positive, otherwise the number of hardware threads
+static inline int thread_count(int requested) {
+	if (requested > 0)
+		return requested;
+	return (int)std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Splits [0, count) into at most `threads` contiguous ranges of similar size and calls `func(first, last, index)`
+// for each range on its own thread; the last range runs on the calling thread
+// Returns the number of ranges used
+template<typename F>
+static inline int parallel_for(size_t count, int threads, F&& func) {
+	threads = (int)std::min((size_t)std::max(threads, 1), std::max(count, (size_t)1));
+	std::vector<std::thread> workers;
+	workers.reserve(threads - 1);
+	for (int i = 0; i < threads - 1; i++)
+		workers.emplace_back([&func, i, count, threads]() { func(count * i / threads, count * (i + 1) / threads, i); });
+	func(count * (threads - 1) / threads, count, threads - 1);
+	for (std::thread& worker: workers)
+		worker.join();
+	return threads;
+}
+
+#endif // PNGSQ_PARALLEL_HPP
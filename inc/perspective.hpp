@@ -5,16 +5,34 @@
 
 #include "defs.hpp"
 #include "matrix.hpp"
+#include "warp.hpp"
 
 // Initializes VAO, shaders and framebuffer
 bool init_shaders_persp(void);
 void deinit_shaders_persp(void);
 
-// Computes the perspective transformation matrix from quadrilateral `img.dewarp_src` to a 2x2 square centred at (0, 0)
-// Based on Heckbert (1989), page 20
+// Computes the perspective transformation matrix from the source image to the output, both in NDC, so that quadrilateral
+// `img.dewarp_src` fills the output
 mat<3> persp_matrix(const struct image& img);
 
-// Uses OpenGL to transform an image using a matrix
+// Uses OpenGL to transform an image using a matrix, waiting for the result
 void transform_image(struct image& img, const mat<3>& matrix, const struct config& cfg);
+// Queues the same work as `transform_image` without waiting for the GPU; `img.data_dewarp` is sized but not yet filled
+void start_transform(struct image& img, const mat<3>& matrix, const struct config& cfg);
+// Copies the result of the latest `start_transform` into `img.data_dewarp`
+// Returns false if the GPU has not finished it yet (it can then be polled again), or if the output was resized since
+// Without `wait`, this only blocks on contexts older than OpenGL 3.2, which lack fences
+bool finish_transform(struct image& img, bool wait = false);
+// Debugging aid: dewarps `img` with `start_transform` and with `warp_image` and prints how far apart the two are
+// With `overlap`, a different transform is started and abandoned first, and the result is polled for instead of waited on
+// Needs a current OpenGL context; `img.data_dewarp` is left holding the OpenGL result
+// Returns the largest difference in any channel, or -1 if either transform failed
+int compare_transforms(struct image& img, const struct config& cfg, bool overlap = false);
+// Runs `compare_transforms` on each of `count` images, through several quadrilaterals and output sizes in turn as if
+// their corners were dragged, with tiles of at most `tile` texels across if that is above 0
+// Returns false if an image fails to load or the two transforms differ by more than the GPU's filtering can explain
+bool check_transforms(char const* const* paths, int count, int tile = 0);
+// Must be called when the source image is freed, since the uploaded copy is only checked against its address
+void forget_transform_source(void);
 
 #endif // PNGSQ_PERSPECTIVE_HPP
@@ -0,0 +1,13 @@
+#ifndef PNGSQ_PNGSQUISH_HPP
+#define PNGSQ_PNGSQUISH_HPP
+
+// Public header of the `pngsquish_core` library
+// Does not depend on OpenGL, GLFW, Dear ImGui or NFD
+
+#include "defs.hpp"
+#include "head.hpp"
+#include "batch.hpp"
+#include "random.hpp"
+#include "warp.hpp"
+
+#endif // PNGSQ_PNGSQUISH_HPP
@@ -0,0 +1,61 @@
+#ifndef PNGSQ_QUEUE_HPP
+#define PNGSQ_QUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Thread-safe FIFO queue that blocks producers while it is full
+template<typename T>
+class bounded_queue {
+protected:
+	std::deque<T> items;
+	std::mutex mutex;
+	std::condition_variable not_empty, not_full;
+	size_t capacity;
+	bool closed;
+public:
+	inline bounded_queue(size_t capacity);
+
+	// Blocks while the queue is full
+	inline void push(T item);
+	// Blocks while the queue is empty
+	// Returns false once the queue has been closed and emptied
+	inline bool pop(T& item);
+	// Wakes up all consumers once the remaining items have been taken
+	inline void close(void);
+};
+
+template<typename T>
+inline bounded_queue<T>::bounded_queue(size_t capacity) : capacity(capacity ? capacity : 1), closed(false) { }
+
+template<typename T>
+inline void bounded_queue<T>::push(T item) {
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->not_full.wait(lock, [this]() { return this->items.size() < this->capacity; });
+	this->items.push_back(std::move(item));
+	lock.unlock();
+	this->not_empty.notify_one();
+}
+
+template<typename T>
+inline bool bounded_queue<T>::pop(T& item) {
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->not_empty.wait(lock, [this]() { return !this->items.empty() || this->closed; });
+	if (this->items.empty())
+		return false;
+	item = std::move(this->items.front());
+	this->items.pop_front();
+	lock.unlock();
+	this->not_full.notify_one();
+	return true;
+}
+
+template<typename T>
+inline void bounded_queue<T>::close(void) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->closed = true;
+	this->not_empty.notify_all();
+}
+
+#endif // PNGSQ_QUEUE_HPP
@@ -1,35 +1,139 @@
 #ifndef PNGSQ_RANDOM_HPP
 #define PNGSQ_RANDOM_HPP
 
+#include <bit>
+#include <cmath>
 #include <cstdint>
-#include <functional>
 
-void init_rand(void);
+// Returns a seed from std::random_device
+uint64_t random_seed(void);
 
-// Returns a random integer on [0, UINT32_MAX]
-uint32_t mix32_rand(void);
+// Splittable pseudorandom number generator, based on SplitMix from Steele et al. (2014)
+// A generator may only be used by one thread at a time; other threads should be given their own with `split`
+// The same seed always gives the same sequence, including that of every generator split from it
+class rand_gen {
+protected:
+	uint64_t seed, gamma; // `gamma` is always odd
+public:
+	inline rand_gen(void);
+	inline explicit rand_gen(uint64_t seed);
 
-// Returns a random integer on [0, n) not exceeding UINT32_MAX
-uint32_t mix32_rand(uint32_t n);
+	// Returns a new generator, advancing this one; the two sequences are independent
+	inline rand_gen split(void);
 
-// Returns a weighted random number on [0, n) if all probabilities add to 1
-// The denominator should not exceed UINT32_MAX
-uint32_t mix32_rand(uint32_t n, float const* numerators, float denominator);
+	// Returns a random integer on [0, UINT32_MAX]
+	inline uint32_t next32(void);
+	// Returns a random integer on [0, n) not exceeding UINT32_MAX
+	inline uint32_t next32(uint32_t n);
+	// Returns a random integer on [0, UINT64_MAX]
+	inline uint64_t next64(void);
+	// Returns a random integer on [0, n) not exceeding UINT64_MAX
+	inline uint64_t next64(uint64_t n);
 
-// Returns a number on (0, 1) weighted according to the probability density function `pdf`
-float mix32_rand_pdf(float mode, std::function<float(float)> pdf);
+	// Returns a random number on (0, 1)
+	inline double unit(void);
+	// Returns a normally distributed random number with mean 0 and variance 1
+	inline double normal(void);
+	// Returns a gamma distributed random number with shape `alpha` and scale 1
+	inline double gamma_variate(double alpha);
+	// Returns a beta distributed random number with shape parameters `alpha` and `beta`
+	inline double beta_variate(double alpha, double beta);
+protected:
+	static constexpr uint64_t golden_gamma = 0x9e3779b97f4a7c15ULL; // ((sqrt5-1)/2) * 2^64
+	inline rand_gen(uint64_t seed, uint64_t gamma);
+	static constexpr uint32_t mix32(uint64_t input);
+	static constexpr uint64_t mix64(uint64_t input);
+	static constexpr uint64_t mix_gamma(uint64_t input);
+};
 
-// Returns a random integer on [0, UINT64_MAX]
-uint64_t mix64_rand(void);
+inline rand_gen::rand_gen(void) : seed(0), gamma(golden_gamma) {}
 
-// Returns a random integer on [0, n) not exceeding UINT64_MAX
-uint64_t mix64_rand(uint64_t n);
+inline rand_gen::rand_gen(uint64_t seed) : seed(seed), gamma(golden_gamma) {}
 
-// Returns a weighted random number on [0, n) if all probabilities add to 1
-// The denominator should not exceed UINT64_MAX
-uint64_t mix64_rand(uint64_t n, double const* numerators, double denominator);
+inline rand_gen::rand_gen(uint64_t seed, uint64_t gamma) : seed(seed), gamma(gamma) {}
 
-// Returns a number on (0, 1) weighted according to the probability density function `pdf`
-double mix64_rand_pdf(double mode, std::function<double(double)> pdf);
+// `mix32` from Steele et al. (2014)
+constexpr uint32_t rand_gen::mix32(uint64_t input) {
+	input = (input ^ (input >> 33)) * 0xff51afd7ed558ccdULL;
+	input = (input ^ (input >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	return (uint32_t)(input >> 32);
+}
+
+// `mix64variant13` from Steele et al. (2014)
+constexpr uint64_t rand_gen::mix64(uint64_t input) {
+	input = (input ^ (input >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	input = (input ^ (input >> 27)) * 0x94d049bb133111ebULL;
+	return input ^ (input >> 31);
+}
+
+// `mixGamma` from Steele et al. (2014), which avoids gammas with too few bit transitions
+constexpr uint64_t rand_gen::mix_gamma(uint64_t input) {
+	input = mix64(input) | 1;
+	return std::popcount(input ^ (input >> 1)) < 24 ? input ^ 0xaaaaaaaaaaaaaaaaULL : input;
+}
+
+inline rand_gen rand_gen::split(void) {
+	const uint64_t seed = mix64(this->seed += this->gamma);
+	return rand_gen(seed, mix_gamma(this->seed += this->gamma));
+}
+
+inline uint32_t rand_gen::next32(void) {
+	return mix32(this->seed += this->gamma);
+}
+
+inline uint32_t rand_gen::next32(uint32_t n) {
+	const uint32_t limit = UINT32_MAX - UINT32_MAX % n;
+	uint32_t result;
+	while ((result = this->next32()) >= limit);
+	return result % n;
+}
+
+inline uint64_t rand_gen::next64(void) {
+	return mix64(this->seed += this->gamma);
+}
+
+inline uint64_t rand_gen::next64(uint64_t n) {
+	const uint64_t limit = UINT64_MAX - UINT64_MAX % n;
+	uint64_t result;
+	while ((result = this->next64()) >= limit);
+	return result % n;
+}
+
+inline double rand_gen::unit(void) {
+	return ((this->next64() >> 11) + 0.5) * 0x1p-53;
+}
+
+// Polar method from Marsaglia and Bray (1964)
+inline double rand_gen::normal(void) {
+	double x, y, s;
+	do {
+		x = 2.0 * this->unit() - 1.0;
+		y = 2.0 * this->unit() - 1.0;
+		s = x * x + y * y;
+	} while (s >= 1.0);
+	return x * std::sqrt(-2.0 * std::log(s) / s);
+}
+
+// Marsaglia and Tsang (2000)
+// Fewer than 5% of attempts are rejected for any shape of at least 1
+inline double rand_gen::gamma_variate(double alpha) {
+	if (alpha < 1.0) // Boost the shape and scale the result back down
+		return this->gamma_variate(alpha + 1.0) * std::pow(this->unit(), 1.0 / alpha);
+	const double d = alpha - 1.0 / 3.0, c = 1.0 / std::sqrt(9.0 * d);
+	while (1) {
+		const double x = this->normal(), t = 1.0 + c * x;
+		if (t <= 0.0)
+			continue;
+		const double v = t * t * t, u = this->unit();
+		// Cheap test first, accepting most attempts without computing a logarithm
+		if (u < 1.0 - 0.0331 * (x * x) * (x * x) || std::log(u) < 0.5 * x * x + d * (1.0 - v + std::log(v)))
+			return d * v;
+	}
+}
+
+inline double rand_gen::beta_variate(double alpha, double beta) {
+	const double x = this->gamma_variate(alpha);
+	return x / (x + this->gamma_variate(beta));
+}
 
 #endif // PNGSQ_RANDOM_HPP
@@ -0,0 +1,46 @@
+#ifndef PNGSQ_SIMD_HPP
+#define PNGSQ_SIMD_HPP
+
+#include "defs.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#	define PNGSQ_X86
+#	include <immintrin.h>
+#endif
+
+// Enables an instruction set for a single function so that the rest of the program runs on any CPU
+// MSVC allows intrinsics in any function
+#if defined(PNGSQ_X86) && !defined(_MSC_VER)
+#	define PNGSQ_TARGET(x) __attribute__((target(x)))
+#else
+#	define PNGSQ_TARGET(x)
+#endif
+
+#define PNGSQ_SIMD_NONE  0
+#define PNGSQ_SIMD_SSE41 1
+#define PNGSQ_SIMD_AVX2  2
+
+#ifdef PNGSQ_X86
+// Splits 8 interleaved colours into their red, green and blue bytes (in the low 8 bytes of each result)
+PNGSQ_TARGET("sse4.1")
+static inline void deinterleave8(struct rgb const* colours, __m128i& r, __m128i& g, __m128i& b) {
+	unsigned char const* const bytes = reinterpret_cast<unsigned char const*>(colours);
+	const __m128i lo = _mm_loadu_si128(reinterpret_cast<__m128i const*>(bytes));
+	const __m128i hi = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(bytes + 16));
+	r = _mm_or_si128(
+		_mm_shuffle_epi8(lo, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1)));
+	g = _mm_or_si128(
+		_mm_shuffle_epi8(lo, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, -1, -1, -1, -1, -1, -1, -1, -1)));
+	b = _mm_or_si128(
+		_mm_shuffle_epi8(lo, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+}
+#endif // PNGSQ_X86
+
+// Returns the best instruction set supported by the CPU and operating system
+// Can be lowered with the environment variable PNGSQUISH_SIMD (none, sse4.1 or avx2), e.g. for comparisons
+int simd_level(void);
+
+#endif // PNGSQ_SIMD_HPP
@@ -0,0 +1,19 @@
+#ifndef PNGSQ_WARP_HPP
+#define PNGSQ_WARP_HPP
+
+#include "defs.hpp"
+#include "matrix.hpp"
+
+// Computes the perspective transformation matrix from the unit square to quadrilateral `img.dewarp_src` in image coordinates
+mat<3> quad_matrix(const struct image& img);
+
+// Transforms an image on the CPU using a matrix from `quad_matrix`, without requiring an OpenGL context
+// Samples like `transform_image` (bilinear, clamped to the edges); bands of rows are split across `threads` threads
+// (0 for one per hardware thread)
+// Returns false if memory could not be allocated
+bool warp_image(struct image& img, const mat<3>& matrix, int threads = 1);
+// Transforms every `step`-th pixel from column `first` up to `last` of output row `y` into `out`, packed together,
+// giving the same values as `warp_image` would at those pixels
+void warp_row(const struct image& img, const mat<3>& matrix, int y, int first, int last, int step, unsigned char* out);
+
+#endif // PNGSQ_WARP_HPP
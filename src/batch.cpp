@@ -0,0 +1,547 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <semaphore>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libdeflate/libdeflate.h"
+
+#include "head.hpp"
+#include "batch.hpp"
+#include "queue.hpp"
+#include "random.hpp"
+#include "warp.hpp"
+
+// Covers the whole image, i.e. no dewarping
+static constexpr struct quad full_quad = {{ { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 1.0f, 1.0f }, { 0.0f, 1.0f } }};
+
+struct page_quad {
+	std::string name;
+	struct quad quad;
+};
+
+struct job {
+	struct config cfg;
+	std::vector<struct threshold> thresholds;
+	struct quad quad;
+	std::vector<struct page_quad> page_quads;
+	int level;
+};
+
+struct page {
+	std::string in, out;
+	struct quad quad;
+};
+
+static void usage(void) {
+	std::fprintf(stderr,
+		"Usage: pngsquish --in <files|dirs...> --out <dir> [--job <file>] [--threads <n>] [--page-threads <n>]\n"
+		"                 [--inflight <n>]\n"
+		"\n"
+		"  --threads <n>               Worker threads per stage (default: number of cores)\n"
+		"  --page-threads <n>          Threads used within a page by each worker (default: 1)\n"
+		"  --inflight <n>              Maximum number of pages held in memory (default: min(threads, 8))\n"
+		"\n"
+		"Job file syntax (one setting per line, # starts a comment):\n"
+		"  width <px>                  Output width (0 to match the input)\n"
+		"  height <px>                 Output height (0 to match the input)\n"
+		"  cluster <sample|histogram>  Cluster sampled pixels, or every pixel counted by colour (default: sample)\n"
+		"  sampled <n>                 Number of colours sampled\n"
+		"  seeding <pp|parallel>       Pick the initial palette with k-means++ or k-means|| (default: pp)\n"
+		"  trials <n>                  Independent clustering runs, keeping the best palette (default: 1)\n"
+		"  iters <n>                   Maximum number of k-means iterations\n"
+		"  tolerance <x>               Stop k-means once no palette entry moves further than this (default: 0)\n"
+		"  fused <n>                   Dewarp, classify and quantize in one pass, estimating the background and\n"
+		"                              palette from every n-th pixel across and down first (default: 0, separately)\n"
+		"  dark <0|1>                  Background is darker than the text\n"
+		"  bg_before <rrggbb>          Override background before processing\n"
+		"  bg_after <rrggbb>           Override background after processing\n"
+		"  threshold <range|compare> <hue> <saturation> <value>\n"
+		"  quad <x0> <y0> ... <x3> <y3> [file]\n"
+		"                              Dewarp corners in normalized coordinates (origin at the bottom left),\n"
+		"                              counterclockwise from the bottom-left corner; applies to every page\n"
+		"                              unless a file name is given\n"
+		"  level <0-12>                Compression level (0 stores the data uncompressed)\n"
+		"  filter <none|heuristic|trial>\n"
+		"                              PNG filter for each row: none, the smallest sum of absolute differences, or\n"
+		"                              the smallest after trial compression, never larger than none (default: none)\n"
+		"  effort <preview|fast|default|high|archival>\n"
+		"                              Sets level and filter together; settings after it override them\n"
+		"  segment <KiB>               Deflate rows in independent segments of this size, one page thread each,\n"
+		"                              at a small cost in size (default: 0, one segment per page thread)\n"
+		"  seed <n>                    Random seed, for identical output across runs (default: a new seed every run)\n");
+}
+
+static std::filesystem::path from_utf8(char const* str) {
+	return std::filesystem::path(reinterpret_cast<char8_t const*>(str));
+}
+
+static std::string to_utf8(const std::filesystem::path& path) {
+	const std::u8string str = path.u8string();
+	return std::string(reinterpret_cast<char const*>(str.data()), str.size());
+}
+
+// Checks if a path has an extension that stb_image can load
+static bool is_image(const std::filesystem::path& path) {
+	static char const* const exts[] = {
+		".png", ".jpg", ".jpeg", ".jpe", ".jif", ".jfif", ".jfi", ".bmp", ".dib", ".gif", ".tga", ".pnm", ".ppm", ".pgm"
+	};
+	std::string ext = to_utf8(path.extension());
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char ch) { return (char)std::tolower(ch); });
+	return std::find_if(std::begin(exts), std::end(exts), [&ext](char const* e) { return ext == e; }) != std::end(exts);
+}
+
+static bool parse_colour(const std::string& str, struct rgb& out) {
+	char const* hex = str.c_str() + (str[0] == '#');
+	char* end = nullptr;
+	if (std::strlen(hex) != 6)
+		return false;
+	unsigned long val = std::strtoul(hex, &end, 16);
+	if (*end != '\0')
+		return false;
+	out = { (unsigned char)(val >> 16), (unsigned char)(val >> 8), (unsigned char)val };
+	return true;
+}
+
+// Named trade-offs between encoding time and file size, from quick previews to files that are served many times
+struct effort {
+	char const* name;
+	int level, filter;
+};
+static constexpr struct effort efforts[] = {
+	{ "preview",  1, PNGSQ_FILTER_NONE },
+	{ "fast",     6, PNGSQ_FILTER_NONE },
+	{ "default",  9, PNGSQ_FILTER_NONE },
+	{ "high",    12, PNGSQ_FILTER_NONE },
+	{ "archival", 12, PNGSQ_FILTER_TRIAL }
+};
+
+static bool parse_job(struct job& job, char const* path) {
+	std::ifstream in(path);
+	if (!in) {
+		std::fprintf(stderr, PNGSQ_ERROR_STRING "Could not open job file %s\n", path);
+		return false;
+	}
+	std::string line;
+	for (int number = 1; std::getline(in, line); number++) {
+		line = line.substr(0, line.find('#'));
+		std::istringstream words(line);
+		std::string key, str;
+		if (!(words >> key))
+			continue;
+		bool ok = true;
+		if (key == "width")
+			ok = (bool)(words >> job.cfg.width) && job.cfg.width >= 0;
+		else if (key == "height")
+			ok = (bool)(words >> job.cfg.height) && job.cfg.height >= 0;
+		else if (key == "cluster") {
+			ok = (bool)(words >> str) && (str == "sample" || str == "histogram");
+			job.cfg.cluster = str == "histogram" ? PNGSQ_CLUSTER_HISTOGRAM : PNGSQ_CLUSTER_SAMPLE;
+		}
+		else if (key == "seeding") {
+			ok = (bool)(words >> str) && (str == "pp" || str == "parallel");
+			job.cfg.seeding = str == "parallel" ? PNGSQ_SEED_PARALLEL : PNGSQ_SEED_PP;
+		}
+		else if (key == "trials")
+			ok = (bool)(words >> job.cfg.trials) && job.cfg.trials > 0;
+		else if (key == "sampled")
+			ok = (bool)(words >> job.cfg.sampled) && job.cfg.sampled > 0;
+		else if (key == "iters")
+			ok = (bool)(words >> job.cfg.iters) && job.cfg.iters >= 0;
+		else if (key == "tolerance")
+			ok = (bool)(words >> job.cfg.tolerance) && job.cfg.tolerance >= 0.0f;
+		else if (key == "fused")
+			ok = (bool)(words >> job.cfg.fused) && job.cfg.fused >= 0;
+		else if (key == "dark")
+			ok = (bool)(words >> job.cfg.dark);
+		else if (key == "bg_before") {
+			ok = (bool)(words >> str) && parse_colour(str, job.cfg.ovr_bg_before_col);
+			job.cfg.ovr_bg_before = true;
+		}
+		else if (key == "bg_after") {
+			ok = (bool)(words >> str) && parse_colour(str, job.cfg.ovr_bg_after_col);
+			job.cfg.ovr_bg_after = true;
+		}
+		else if (key == "threshold") {
+			struct threshold thr = { .enabled = true };
+			ok = (bool)(words >> str >> thr.diff.h >> thr.diff.s >> thr.diff.v) && (str == "range" || str == "compare");
+			thr.mode = str == "compare" ? PNGSQ_VAL_MODE_COMPARE : PNGSQ_VAL_MODE_RANGE;
+			job.thresholds.push_back(thr);
+		}
+		else if (key == "quad") {
+			struct quad quad;
+			for (int i = 0; i < 4 && ok; i++)
+				ok = (bool)(words >> quad.p[i].x >> quad.p[i].y);
+			std::getline(words >> std::ws, str);
+			if (ok && str.empty())
+				job.quad = quad;
+			else if (ok)
+				job.page_quads.push_back({ str, quad });
+		}
+		else if (key == "seed")
+			ok = (bool)(words >> job.cfg.seed);
+		else if (key == "level")
+			ok = (bool)(words >> job.level) && job.level >= 0 && job.level <= 12;
+		else if (key == "filter") {
+			ok = (bool)(words >> str) && (str == "none" || str == "heuristic" || str == "trial");
+			job.cfg.filter = str == "trial" ? PNGSQ_FILTER_TRIAL : str == "heuristic" ? PNGSQ_FILTER_HEURISTIC : PNGSQ_FILTER_NONE;
+		}
+		else if (key == "effort") {
+			ok = (bool)(words >> str);
+			const struct effort* const preset = std::find_if(std::begin(efforts), std::end(efforts),
+				[&str](const struct effort& e) { return str == e.name; });
+			if (ok && (ok = preset != std::end(efforts))) {
+				job.level = preset->level;
+				job.cfg.filter = preset->filter;
+			}
+		}
+		else if (key == "segment")
+			ok = (bool)(words >> job.cfg.segment) && job.cfg.segment >= 0;
+		else {
+			std::fprintf(stderr, PNGSQ_ERROR_STRING "%s:%d: Unknown setting \"%s\"\n", path, number, key.c_str());
+			return false;
+		}
+		if (!ok) {
+			std::fprintf(stderr, PNGSQ_ERROR_STRING "%s:%d: Invalid value for \"%s\"\n", path, number, key.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the absolute path of `path` with links resolved as far as it exists, or just normalized if that fails
+static std::filesystem::path identity(const std::filesystem::path& path) {
+	std::error_code err;
+	std::filesystem::path result = std::filesystem::weakly_canonical(path, err);
+	return err ? path.lexically_normal() : result;
+}
+
+// Lower-cases the ASCII letters of `path`, to match paths on filesystems that ignore case
+static std::string fold_case(const std::filesystem::path& path) {
+	std::string str = to_utf8(path);
+	std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+	return str;
+}
+
+// Reports pages that would write the same output file, or overwrite one of the inputs
+// Returns false if there are any, before anything has been written
+static bool check_outputs(const std::vector<struct page>& pages) {
+	// Inputs are identified once, by path and by path with its case folded; `equivalent` only has to settle outputs
+	// that match an input in everything but case, which are the same file on filesystems that ignore case
+	std::map<std::filesystem::path, const struct page*> inputs;
+	std::map<std::string, const struct page*> folded;
+	for (const struct page& page: pages) {
+		const std::filesystem::path in = identity(from_utf8(page.in.c_str()));
+		inputs.emplace(in, &page);
+		folded.emplace(fold_case(in), &page);
+	}
+	std::map<std::filesystem::path, const struct page*> outputs;
+	bool ok = true;
+	for (const struct page& page: pages) {
+		const std::filesystem::path out = identity(from_utf8(page.out.c_str()));
+		const auto [it, added] = outputs.emplace(out, &page);
+		if (!added) {
+			std::fprintf(stderr, PNGSQ_ERROR_STRING "%s and %s would both be written to %s\n",
+				it->second->in.c_str(), page.in.c_str(), page.out.c_str());
+			ok = false;
+		}
+		bool overwrites = inputs.find(out) != inputs.end();
+		if (!overwrites) {
+			const auto input = folded.find(fold_case(out));
+			std::error_code err;
+			overwrites = input != folded.end() && std::filesystem::equivalent(from_utf8(input->second->in.c_str()), out, err);
+		}
+		if (overwrites) {
+			std::fprintf(stderr, PNGSQ_ERROR_STRING "Output %s would overwrite an input\n", page.out.c_str());
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// Matches `width` and `height` in `cfg`, where zero means the input size (scaled proportionally if the other is given)
+static void output_size(struct image& img, const struct config& cfg) {
+	img.out_width = cfg.width;
+	img.out_height = cfg.height;
+	if (cfg.width == 0 && cfg.height == 0) {
+		img.out_width = img.full_width;
+		img.out_height = img.full_height;
+	}
+	else if (cfg.width == 0)
+		img.out_width = std::max(1, (int)std::lround((double)cfg.height * img.full_width / img.full_height));
+	else if (cfg.height == 0)
+		img.out_height = std::max(1, (int)std::lround((double)cfg.width * img.full_height / img.full_width));
+}
+
+// A page moving through the pipeline
+struct work {
+	const struct page* page;
+	struct image img;
+	rand_gen rng; // Split from the job's generator in page order, so that results do not depend on scheduling
+	bool ok;
+};
+
+struct stage {
+	char const* name;
+	int workers;
+	// Called with the index of the worker thread; returns false on failure
+	std::function<bool(struct work&, int)> process;
+	std::atomic<int64_t> nanoseconds;
+};
+
+// Starts the worker threads of `stage`, which take pages from `in` and pass them on to `out`
+// Pages that failed in an earlier stage are passed on without being processed
+// `out` is closed when the last worker exits
+static void start_stage(std::vector<std::thread>& threads, struct stage& stage, bounded_queue<struct work*>& in, bounded_queue<struct work*>& out) {
+	auto remaining = std::make_shared<std::atomic<int>>(stage.workers);
+	for (int worker = 0; worker < stage.workers; worker++) {
+		threads.emplace_back([&stage, &in, &out, remaining, worker]() {
+			struct work* w = nullptr;
+			while (in.pop(w)) {
+				if (w->ok) {
+					const auto start = std::chrono::steady_clock::now();
+					w->ok = stage.process(*w, worker);
+					stage.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+				}
+				out.push(w);
+			}
+			if (--*remaining == 0)
+				out.close();
+		});
+	}
+}
+
+// Parses the value `str` of command-line option `option` into `value`, which must be a whole number of at least 1
+// Prints the error and usage otherwise
+static bool parse_count(char const* option, char const* str, int& value) {
+	char* end = nullptr;
+	errno = 0;
+	const long parsed = std::strtol(str, &end, 10);
+	if (end == str || *end != '\0' || errno == ERANGE || parsed < 1 || parsed > INT_MAX) {
+		std::fprintf(stderr, PNGSQ_ERROR_STRING "Invalid value for %s: \"%s\"\n", option, str);
+		usage();
+		return false;
+	}
+	value = (int)parsed;
+	return true;
+}
+
+int run_batch(int argc, char** argv) {
+	struct job job = {
+		.cfg = {
+			.sampled = 10000,
+			.iters = 20,
+			.threads = 1
+		},
+		.quad = full_quad,
+		.level = 9
+	};
+	std::vector<std::string> inputs;
+	char const* out_dir = nullptr;
+	char const* job_path = nullptr;
+	int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+	int inflight = 0;
+	bool in_list = false; // Arguments following `--in` are inputs
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--in") == 0)
+			in_list = true;
+		else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			out_dir = argv[++i];
+			in_list = false;
+		}
+		else if (std::strcmp(argv[i], "--job") == 0 && i + 1 < argc) {
+			job_path = argv[++i];
+			in_list = false;
+		}
+		else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			if (!parse_count(argv[i], argv[i + 1], threads))
+				return EXIT_FAILURE;
+			i++;
+			in_list = false;
+		}
+		else if (std::strcmp(argv[i], "--page-threads") == 0 && i + 1 < argc) {
+			if (!parse_count(argv[i], argv[i + 1], job.cfg.threads))
+				return EXIT_FAILURE;
+			i++;
+			in_list = false;
+		}
+		else if (std::strcmp(argv[i], "--inflight") == 0 && i + 1 < argc) {
+			if (!parse_count(argv[i], argv[i + 1], inflight))
+				return EXIT_FAILURE;
+			i++;
+			in_list = false;
+		}
+		else if (in_list && std::strncmp(argv[i], "--", 2) != 0)
+			inputs.push_back(argv[i]);
+		else {
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (inputs.empty() || out_dir == nullptr) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (job_path != nullptr && !parse_job(job, job_path))
+		return EXIT_FAILURE;
+	if (job.thresholds.empty()) {
+		// Similar to the defaults from the blog post
+		static constexpr struct threshold thr_default = {
+			.selected = false,
+			.diff = { 180.0f, 0.2f, 0.25f },
+			.mode = PNGSQ_VAL_MODE_RANGE,
+			.enabled = true
+		};
+		job.thresholds.push_back(thr_default);
+	}
+
+	std::error_code err;
+	const std::filesystem::path out = from_utf8(out_dir);
+	std::filesystem::create_directories(out, err);
+	if (!std::filesystem::is_directory(out)) {
+		std::fprintf(stderr, PNGSQ_ERROR_STRING "Could not create output directory %s\n", out_dir);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<struct page> pages;
+	for (const std::string& input: inputs) {
+		const std::filesystem::path path = from_utf8(input.c_str());
+		std::vector<std::filesystem::path> files;
+		if (std::filesystem::is_directory(path)) {
+			for (const auto& entry: std::filesystem::directory_iterator(path, err))
+				if (entry.is_regular_file() && is_image(entry.path()))
+					files.push_back(entry.path());
+			std::sort(files.begin(), files.end());
+		}
+		else
+			files.push_back(path);
+		for (const std::filesystem::path& file: files) {
+			struct page page = {
+				.in = to_utf8(file),
+				.out = to_utf8(out / file.stem().concat(".png")),
+				.quad = job.quad
+			};
+			const std::string name = to_utf8(file.filename());
+			for (const struct page_quad& pq: job.page_quads)
+				if (pq.name == name || pq.name == page.in)
+					page.quad = pq.quad;
+			pages.push_back(page);
+		}
+	}
+	if (!check_outputs(pages))
+		return EXIT_FAILURE;
+
+	if (inflight == 0)
+		inflight = std::min(threads, 8);
+	// Each encode worker has one compressor for each of its page threads
+	std::vector<struct libdeflate_compressor*> compressors((size_t)threads * job.cfg.threads);
+	for (struct libdeflate_compressor*& compressor: compressors) {
+		if ((compressor = libdeflate_alloc_compressor(job.level)) == nullptr) {
+			std::fprintf(stderr, PNGSQ_ERROR_STRING "Could not allocate compressor\n");
+			std::for_each(compressors.begin(), compressors.end(), libdeflate_free_compressor);
+			return EXIT_FAILURE;
+		}
+	}
+	const uint64_t seed = job.cfg.seed != 0 ? job.cfg.seed : random_seed();
+	rand_gen rng(seed);
+
+	// Each page is decoded, dewarped, classified, quantized and encoded by a separate stage, so that
+	// consecutive pages overlap. At most `inflight` pages are held in memory at once.
+	// In fused mode the dewarp stage does the classification and quantization as well, and the next two pass pages on.
+	struct stage stages[] = {
+		{ "decode", threads, [&job](struct work& w, int) {
+			if (!load_image(w.img, w.page->in.c_str())) {
+				std::fprintf(stderr, PNGSQ_ERROR_STRING "Could not load %s\n", w.page->in.c_str());
+				return false;
+			}
+			w.img.dewarp_src = w.page->quad;
+			output_size(w.img, job.cfg);
+			return true;
+		}},
+		{ "dewarp", threads, [&job](struct work& w, int) {
+			if (job.cfg.fused > 0 ? squish_fused(w.img, job.thresholds, job.cfg, w.rng) : warp_image(w.img, quad_matrix(w.img), job.cfg.threads))
+				return true;
+			std::fprintf(stderr, PNGSQ_ERROR_STRING "Out of memory while dewarping %s\n", w.page->in.c_str());
+			return false;
+		}},
+		{ "background", threads, [&job](struct work& w, int) {
+			if (job.cfg.fused == 0)
+				make_background(w.img, job.thresholds, job.cfg);
+			return true;
+		}},
+		{ "palette", threads, [&job](struct work& w, int) {
+			if (job.cfg.fused == 0)
+				make_palette(w.img, job.cfg, w.rng);
+			return true;
+		}},
+		{ "encode", threads, [&job, &compressors](struct work& w, int worker) {
+			if (write_image(w.img, w.page->out.c_str(), &compressors[(size_t)worker * job.cfg.threads], job.cfg))
+				return true;
+			std::fprintf(stderr, PNGSQ_ERROR_STRING "Could not write %s\n", w.page->out.c_str());
+			return false;
+		}}
+	};
+	constexpr size_t count = sizeof(stages) / sizeof(stages[0]);
+
+	std::vector<struct work> works(pages.size());
+	std::deque<bounded_queue<struct work*>> queues;
+	for (size_t i = 0; i <= count; i++)
+		queues.emplace_back(inflight);
+	std::counting_semaphore<> slots(inflight);
+	std::vector<std::thread> workers;
+	const auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++)
+		start_stage(workers, stages[i], queues[i], queues[i + 1]);
+	std::thread feeder([&]() {
+		for (size_t i = 0; i < pages.size(); i++) {
+			slots.acquire();
+			works[i] = { .page = &pages[i], .rng = rng.split(), .ok = true };
+			queues.front().push(&works[i]);
+		}
+		queues.front().close();
+	});
+
+	size_t failed = 0;
+	uintmax_t written = 0; // Total size of the output files, to compare compression settings
+	struct work* w = nullptr;
+	while (queues.back().pop(w)) {
+		if (w->ok) {
+			std::printf("%s -> %s\n", w->page->in.c_str(), w->page->out.c_str());
+			const uintmax_t size = std::filesystem::file_size(from_utf8(w->page->out.c_str()), err);
+			written += err ? 0 : size;
+		}
+		else
+			failed++;
+		free_image(w->img);
+		slots.release();
+	}
+	feeder.join();
+	for (std::thread& worker: workers)
+		worker.join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::for_each(compressors.begin(), compressors.end(), libdeflate_free_compressor);
+
+	std::printf("%zu of %zu pages processed in %.2f s (%.2f pages/s), %.1f KiB written, seed %llu\n",
+		pages.size() - failed, pages.size(), seconds, seconds > 0.0 ? pages.size() / seconds : 0.0, written / 1024.0,
+		(unsigned long long)seed);
+	for (const struct stage& stage: stages)
+		std::printf("  %-10s %8.2f s\n", stage.name, stage.nanoseconds / 1e9);
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "classify.hpp"
+#include "simd.hpp"
+
+struct hsv to_hsv(unsigned char r, unsigned char g, unsigned char b) {
+	float _r = r / 255.0f, _g = g / 255.0f, _b = b / 255.0f;
+	float v = std::max({_r, _g, _b});
+	float d = v - std::min({_r, _g, _b});
+	float s = v ? (d / v) : 0.0f;
+	float h = 0.0f;
+	if (d <= 0.0f) return { h, s, v };
+	else if (v == _r) h = (_g - _b) / d + 0.0f;
+	else if (v == _g) h = (_b - _r) / d + 2.0f;
+	else if (v == _b) h = (_r - _g) / d + 4.0f;
+	if (h < 0.0f) h += 6.0f;
+	h *= 60.0f;
+	return { h, s, v };
+}
+
+struct hsv hsv_diff(const struct hsv& x, const struct hsv& y) {
+	float h = std::abs(x.h - y.h);
+	float s = std::abs(x.s - y.s);
+	float v = std::abs(x.v - y.v);
+	return { std::min(h, 360.0f - h), s, v };
+}
+
+static constexpr bool operator==(const struct threshold& left, const struct threshold& right) {
+	return left.diff.h == right.diff.h && left.diff.s == right.diff.s && left.diff.v == right.diff.v && left.mode == right.mode;
+}
+
+bg_table::bg_table(void) : states(new uint8_t[colours / 4]()), background{ 0, 0, 0 }, bg_hsv{ 0.0f, 0.0f, 0.0f }, dark(false) { }
+
+void bg_table::compile(const std::vector<struct threshold>& thrs, const struct rgb& background, bool dark) {
+	std::vector<struct threshold> enabled;
+	std::copy_if(thrs.begin(), thrs.end(), std::back_inserter(enabled), [](const struct threshold& thr) { return thr.enabled; });
+	if (enabled == this->thrs && background == this->background && dark == this->dark)
+		return;
+	this->thrs = std::move(enabled);
+	this->background = background;
+	this->bg_hsv = to_hsv(background.r, background.g, background.b);
+	this->dark = dark;
+	std::memset(this->states.get(), 0, colours / 4);
+}
+
+bool bg_table::evaluate(const struct rgb& colour) const {
+	const struct hsv pixel = to_hsv(colour.r, colour.g, colour.b);
+	const struct hsv diff = hsv_diff(pixel, this->bg_hsv);
+	for (const struct threshold& thr: this->thrs) {
+		if (diff.h > thr.diff.h || diff.s > thr.diff.s || (!thr.mode && diff.v > thr.diff.v))
+			continue;
+		else if (thr.mode && !this->dark && pixel.v < this->bg_hsv.v - thr.diff.v)
+			continue;
+		else if (thr.mode && this->dark && pixel.v > this->bg_hsv.v + thr.diff.v)
+			continue;
+		return true;
+	}
+	return false;
+}
+
+#ifdef PNGSQ_X86
+// Same operations as `to_hsv`, `hsv_diff` and `bg_table::evaluate` in the same order, so the results are identical
+PNGSQ_TARGET("avx2")
+static uint32_t evaluate8_avx2(struct rgb const* colours, const std::vector<struct threshold>& thrs, const struct hsv& bg, bool dark) {
+	__m128i r8, g8, b8;
+	deinterleave8(colours, r8, g8, b8);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 max = _mm256_set1_ps(255.0f);
+	const __m256 r = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(r8)), max);
+	const __m256 g = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(g8)), max);
+	const __m256 b = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b8)), max);
+	const __m256 v = _mm256_max_ps(_mm256_max_ps(r, g), b);
+	const __m256 d = _mm256_sub_ps(v, _mm256_min_ps(_mm256_min_ps(r, g), b));
+	const __m256 s = _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_NEQ_OQ), _mm256_div_ps(d, v));
+	const __m256 h0 = _mm256_add_ps(_mm256_div_ps(_mm256_sub_ps(g, b), d), zero);
+	const __m256 h1 = _mm256_add_ps(_mm256_div_ps(_mm256_sub_ps(b, r), d), _mm256_set1_ps(2.0f));
+	const __m256 h2 = _mm256_add_ps(_mm256_div_ps(_mm256_sub_ps(r, g), d), _mm256_set1_ps(4.0f));
+	__m256 h = _mm256_blendv_ps(_mm256_blendv_ps(h2, h1, _mm256_cmp_ps(v, g, _CMP_EQ_OQ)), h0, _mm256_cmp_ps(v, r, _CMP_EQ_OQ));
+	h = _mm256_add_ps(h, _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_LT_OQ), _mm256_set1_ps(6.0f)));
+	h = _mm256_and_ps(_mm256_cmp_ps(d, zero, _CMP_GT_OQ), _mm256_mul_ps(h, _mm256_set1_ps(60.0f)));
+
+	const __m256 abs = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	__m256 dh = _mm256_and_ps(_mm256_sub_ps(h, _mm256_set1_ps(bg.h)), abs);
+	dh = _mm256_min_ps(_mm256_sub_ps(_mm256_set1_ps(360.0f), dh), dh);
+	const __m256 ds = _mm256_and_ps(_mm256_sub_ps(s, _mm256_set1_ps(bg.s)), abs);
+	const __m256 dv = _mm256_and_ps(_mm256_sub_ps(v, _mm256_set1_ps(bg.v)), abs);
+
+	__m256 result = zero;
+	for (const struct threshold& thr: thrs) {
+		__m256 pass = _mm256_and_ps(
+			_mm256_cmp_ps(dh, _mm256_set1_ps(thr.diff.h), _CMP_LE_OQ),
+			_mm256_cmp_ps(ds, _mm256_set1_ps(thr.diff.s), _CMP_LE_OQ));
+		if (!thr.mode)
+			pass = _mm256_and_ps(pass, _mm256_cmp_ps(dv, _mm256_set1_ps(thr.diff.v), _CMP_LE_OQ));
+		else if (!dark)
+			pass = _mm256_and_ps(pass, _mm256_cmp_ps(v, _mm256_set1_ps(bg.v - thr.diff.v), _CMP_GE_OQ));
+		else
+			pass = _mm256_and_ps(pass, _mm256_cmp_ps(v, _mm256_set1_ps(bg.v + thr.diff.v), _CMP_LE_OQ));
+		result = _mm256_or_ps(result, pass);
+	}
+	return (uint32_t)_mm256_movemask_ps(result);
+}
+
+PNGSQ_TARGET("sse4.1")
+static uint32_t evaluate4_sse41(__m128i r8, __m128i g8, __m128i b8, const std::vector<struct threshold>& thrs, const struct hsv& bg, bool dark) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 max = _mm_set1_ps(255.0f);
+	const __m128 r = _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(r8)), max);
+	const __m128 g = _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(g8)), max);
+	const __m128 b = _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(b8)), max);
+	const __m128 v = _mm_max_ps(_mm_max_ps(r, g), b);
+	const __m128 d = _mm_sub_ps(v, _mm_min_ps(_mm_min_ps(r, g), b));
+	const __m128 s = _mm_and_ps(_mm_cmpneq_ps(v, zero), _mm_div_ps(d, v));
+	const __m128 h0 = _mm_add_ps(_mm_div_ps(_mm_sub_ps(g, b), d), zero);
+	const __m128 h1 = _mm_add_ps(_mm_div_ps(_mm_sub_ps(b, r), d), _mm_set1_ps(2.0f));
+	const __m128 h2 = _mm_add_ps(_mm_div_ps(_mm_sub_ps(r, g), d), _mm_set1_ps(4.0f));
+	__m128 h = _mm_blendv_ps(_mm_blendv_ps(h2, h1, _mm_cmpeq_ps(v, g)), h0, _mm_cmpeq_ps(v, r));
+	h = _mm_add_ps(h, _mm_and_ps(_mm_cmplt_ps(h, zero), _mm_set1_ps(6.0f)));
+	h = _mm_and_ps(_mm_cmpgt_ps(d, zero), _mm_mul_ps(h, _mm_set1_ps(60.0f)));
+
+	const __m128 abs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 dh = _mm_and_ps(_mm_sub_ps(h, _mm_set1_ps(bg.h)), abs);
+	dh = _mm_min_ps(_mm_sub_ps(_mm_set1_ps(360.0f), dh), dh);
+	const __m128 ds = _mm_and_ps(_mm_sub_ps(s, _mm_set1_ps(bg.s)), abs);
+	const __m128 dv = _mm_and_ps(_mm_sub_ps(v, _mm_set1_ps(bg.v)), abs);
+
+	__m128 result = zero;
+	for (const struct threshold& thr: thrs) {
+		__m128 pass = _mm_and_ps(_mm_cmple_ps(dh, _mm_set1_ps(thr.diff.h)), _mm_cmple_ps(ds, _mm_set1_ps(thr.diff.s)));
+		if (!thr.mode)
+			pass = _mm_and_ps(pass, _mm_cmple_ps(dv, _mm_set1_ps(thr.diff.v)));
+		else if (!dark)
+			pass = _mm_and_ps(pass, _mm_cmpge_ps(v, _mm_set1_ps(bg.v - thr.diff.v)));
+		else
+			pass = _mm_and_ps(pass, _mm_cmple_ps(v, _mm_set1_ps(bg.v + thr.diff.v)));
+		result = _mm_or_ps(result, pass);
+	}
+	return (uint32_t)_mm_movemask_ps(result);
+}
+
+PNGSQ_TARGET("sse4.1")
+static uint32_t evaluate8_sse41(struct rgb const* colours, const std::vector<struct threshold>& thrs, const struct hsv& bg, bool dark) {
+	__m128i r8, g8, b8;
+	deinterleave8(colours, r8, g8, b8);
+	const uint32_t lo = evaluate4_sse41(r8, g8, b8, thrs, bg, dark);
+	const uint32_t hi = evaluate4_sse41(_mm_srli_si128(r8, 4), _mm_srli_si128(g8, 4), _mm_srli_si128(b8, 4), thrs, bg, dark);
+	return lo | (hi << 4);
+}
+#endif // PNGSQ_X86
+
+uint32_t bg_table::evaluate8(struct rgb const* colours) const {
+#ifdef PNGSQ_X86
+	switch (simd_level()) {
+	case PNGSQ_SIMD_AVX2:
+		return evaluate8_avx2(colours, this->thrs, this->bg_hsv, this->dark);
+	case PNGSQ_SIMD_SSE41:
+		return evaluate8_sse41(colours, this->thrs, this->bg_hsv, this->dark);
+	}
+#endif // PNGSQ_X86
+	uint32_t result = 0;
+	for (int i = 0; i < 8; i++)
+		result |= (uint32_t)this->evaluate(colours[i]) << i;
+	return result;
+}
+
+void bg_table::resolve(struct rgb const* pixels, size_t count) {
+	struct rgb pending[8];
+	int n = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (this->state(key(pixels[i])) & 1)
+			continue;
+		pending[n++] = pixels[i];
+		if (n < 8)
+			continue;
+		const uint32_t result = this->evaluate8(pending);
+		for (int j = 0; j < 8; j++)
+			this->store(key(pending[j]), (result >> j) & 1);
+		n = 0;
+	}
+	if (n == 0)
+		return;
+	std::fill(pending + n, pending + 8, pending[0]);
+	const uint32_t result = this->evaluate8(pending);
+	for (int j = 0; j < n; j++)
+		this->store(key(pending[j]), (result >> j) & 1);
+}
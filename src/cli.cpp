@@ -0,0 +1,5 @@
+#include "batch.hpp"
+
+int main(int argc, char** argv) {
+	return run_batch(argc, argv);
+}
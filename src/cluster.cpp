@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "cluster.hpp"
+#include "fenwick.hpp"
+#include "parallel.hpp"
+#include "random.hpp"
+#include "simd.hpp"
+
+static constexpr int dist2(const struct rgb& left, const struct rgb& right) {
+	const int dr = left.r - right.r, dg = left.g - right.g, db = left.b - right.b;
+	return dr * dr + dg * dg + db * db;
+}
+
+// k-means++, based on Arthur and Vassilvitskii (2007)
+// Weighted points are picked in proportion to their weight, with the distances scaled by it
+// Each point keeps its squared distance to the nearest centroid picked so far, and the weighted distances are held in
+// a Fenwick tree so that every pick takes O(log n) instead of a scan over all points
+void k_means_pp(struct rgb* centroids, int k, struct rgb const* points, uint32_t const* weights, size_t n, rand_gen& rng) {
+	auto nearest = std::make_unique<int[]>(n);
+	auto values = std::make_unique<uint64_t[]>(n);
+	auto changed = std::make_unique<size_t[]>(n);
+	auto decreases = std::make_unique<uint64_t[]>(n);
+	// Updating the tree for each changed point costs O(log n), so it is rebuilt in O(n) instead once enough change
+	const size_t rebuild = n / std::max((size_t)1, (size_t)std::bit_width(n));
+	fenwick_tree tree(n);
+	for (size_t i = 0; i < n; i++) {
+		nearest[i] = std::numeric_limits<int>::max();
+		values[i] = weights != nullptr ? weights[i] : 1;
+	}
+	tree.assign(values.get());
+	centroids[0] = points[tree.find(rng.next64(tree.total()))];
+	for (int entry = 1; entry < k; entry++) {
+		size_t count = 0;
+		for (size_t i = 0; i < n; i++) {
+			const int dist = dist2(points[i], centroids[entry - 1]);
+			if (dist >= nearest[i])
+				continue;
+			nearest[i] = dist;
+			const uint64_t value = (weights != nullptr ? weights[i] : 1) * (uint64_t)dist;
+			changed[count] = i;
+			decreases[count++] = values[i] - value;
+			values[i] = value;
+		}
+		if (count > rebuild)
+			tree.assign(values.get());
+		else
+			for (size_t i = 0; i < count; i++)
+				tree.subtract(changed[i], decreases[i]);
+		// Every point coincides with a centroid once the total reaches zero
+		centroids[entry] = points[tree.total() != 0 ? tree.find(rng.next64(tree.total())) : 0];
+	}
+}
+
+// k-means||, based on Bahmani et al. (2012)
+// Each round samples every point independently with probability proportional to its weighted distance to the
+// candidates so far, picking about `2k` new candidates per round. The candidates are then weighted by the points
+// nearest to them and reduced to `k` centroids with k-means++.
+void k_means_par(struct rgb* centroids, int k, struct rgb const* points, uint32_t const* weights, size_t n, rand_gen& rng, int threads) {
+	constexpr int rounds = 5;
+	const double oversampling = 2.0 * k;
+	auto nearest = std::make_unique<int[]>(n);
+	auto owner = std::make_unique<uint32_t[]>(n); // Index of the nearest candidate
+	std::vector<struct rgb> candidates;
+	{
+		// The first candidate is picked in proportion to the weights alone
+		uint64_t total = 0;
+		for (size_t i = 0; i < n; i++)
+			total += weights != nullptr ? weights[i] : 1;
+		uint64_t x = rng.next64(total);
+		size_t first = 0;
+		for (; x >= (weights != nullptr ? weights[first] : 1); first++)
+			x -= weights != nullptr ? weights[first] : 1;
+		candidates.push_back(points[first]);
+	}
+	std::fill(nearest.get(), nearest.get() + n, std::numeric_limits<int>::max());
+	// Points are sampled in blocks of a fixed size, each with its own generator and list of picks, so that the
+	// candidates do not depend on how the blocks are split across threads
+	constexpr size_t block = 1024;
+	const size_t blocks = (n + block - 1) / block;
+	std::vector<uint64_t> costs(blocks);
+	std::vector<std::vector<struct rgb>> picked(blocks);
+	std::vector<rand_gen> rngs(blocks);
+	size_t updated = 0; // Candidates before this one have already been compared against every point
+	for (int round = 0; round <= rounds; round++) {
+		// Bring the distances up to date with the new candidates and sum them up
+		const size_t size = candidates.size();
+		parallel_for(blocks, threads, [&](size_t first, size_t last, int) {
+			for (size_t b = first; b < last; b++) {
+				uint64_t cost = 0;
+				for (size_t i = b * block, end = std::min(i + block, n); i < end; i++) {
+					for (size_t c = updated; c < size; c++) {
+						const int dist = dist2(points[i], candidates[c]);
+						if (dist < nearest[i]) {
+							nearest[i] = dist;
+							owner[i] = (uint32_t)c;
+						}
+					}
+					cost += (weights != nullptr ? weights[i] : 1) * (uint64_t)nearest[i];
+				}
+				costs[b] = cost;
+			}
+		});
+		updated = size;
+		uint64_t cost = 0;
+		for (size_t b = 0; b < blocks; b++)
+			cost += costs[b];
+		if (round == rounds || cost == 0)
+			break;
+		const double scale = oversampling / (double)cost;
+		for (size_t b = 0; b < blocks; b++)
+			rngs[b] = rng.split();
+		parallel_for(blocks, threads, [&](size_t first, size_t last, int) {
+			for (size_t b = first; b < last; b++) {
+				picked[b].clear();
+				for (size_t i = b * block, end = std::min(i + block, n); i < end; i++)
+					if (rngs[b].unit() < scale * (double)((weights != nullptr ? weights[i] : 1) * (uint64_t)nearest[i]))
+						picked[b].push_back(points[i]);
+			}
+		});
+		for (size_t b = 0; b < blocks; b++)
+			candidates.insert(candidates.end(), picked[b].begin(), picked[b].end());
+	}
+	auto counts = std::make_unique<uint32_t[]>(candidates.size());
+	for (size_t i = 0; i < n; i++)
+		counts[owner[i]] += weights != nullptr ? weights[i] : 1;
+	k_means_pp(centroids, k, candidates.data(), counts.get(), candidates.size(), rng);
+}
+
+// Returns the nearest centroid to `point` (the lowest one on ties) along with the squared distances to it and to the
+// second nearest
+static inline int nearest(const struct rgb& point, struct rgb const* centroids, int k, int& best, int& second) {
+	int entry = 0;
+	best = second = std::numeric_limits<int>::max();
+	for (int i = 0; i < k; i++) {
+		const int dist = dist2(point, centroids[i]);
+		if (best > dist) {
+			second = best;
+			best = dist;
+			entry = i;
+		}
+		else if (second > dist)
+			second = dist;
+	}
+	return entry;
+}
+
+#ifdef PNGSQ_X86
+// Same as `nearest` for 8 colours at once, in exact integer arithmetic
+PNGSQ_TARGET("avx2")
+static void nearest8_avx2(struct rgb const* colours, struct rgb const* centroids, int k, unsigned char* entries, int* best, int* second) {
+	__m128i r8, g8, b8;
+	deinterleave8(colours, r8, g8, b8);
+	const __m256i r = _mm256_cvtepu8_epi32(r8), g = _mm256_cvtepu8_epi32(g8), b = _mm256_cvtepu8_epi32(b8);
+	__m256i lo = _mm256_set1_epi32(std::numeric_limits<int>::max()), next = lo, entry = _mm256_setzero_si256();
+	for (int i = 0; i < k; i++) {
+		const __m256i dr = _mm256_sub_epi32(r, _mm256_set1_epi32(centroids[i].r));
+		const __m256i dg = _mm256_sub_epi32(g, _mm256_set1_epi32(centroids[i].g));
+		const __m256i db = _mm256_sub_epi32(b, _mm256_set1_epi32(centroids[i].b));
+		const __m256i dist = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)), _mm256_mullo_epi32(db, db));
+		const __m256i closer = _mm256_cmpgt_epi32(lo, dist);
+		next = _mm256_blendv_epi8(_mm256_min_epi32(next, dist), lo, closer);
+		lo = _mm256_min_epi32(lo, dist);
+		entry = _mm256_blendv_epi8(entry, _mm256_set1_epi32(i), closer);
+	}
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(best), lo);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(second), next);
+	// Entries are below 16, so they fit in the low byte of each lane
+	const __m256i bytes = _mm256_shuffle_epi8(entry, _mm256_setr_epi8(
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+	const uint32_t low = (uint32_t)_mm256_extract_epi32(bytes, 0), high = (uint32_t)_mm256_extract_epi32(bytes, 4);
+	std::memcpy(entries, &low, 4);
+	std::memcpy(entries + 4, &high, 4);
+}
+
+PNGSQ_TARGET("sse4.1")
+static void nearest4_sse41(__m128i r8, __m128i g8, __m128i b8, struct rgb const* centroids, int k, unsigned char* entries, int* best, int* second) {
+	const __m128i r = _mm_cvtepu8_epi32(r8), g = _mm_cvtepu8_epi32(g8), b = _mm_cvtepu8_epi32(b8);
+	__m128i lo = _mm_set1_epi32(std::numeric_limits<int>::max()), next = lo, entry = _mm_setzero_si128();
+	for (int i = 0; i < k; i++) {
+		const __m128i dr = _mm_sub_epi32(r, _mm_set1_epi32(centroids[i].r));
+		const __m128i dg = _mm_sub_epi32(g, _mm_set1_epi32(centroids[i].g));
+		const __m128i db = _mm_sub_epi32(b, _mm_set1_epi32(centroids[i].b));
+		const __m128i dist = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)), _mm_mullo_epi32(db, db));
+		const __m128i closer = _mm_cmpgt_epi32(lo, dist);
+		next = _mm_blendv_epi8(_mm_min_epi32(next, dist), lo, closer);
+		lo = _mm_min_epi32(lo, dist);
+		entry = _mm_blendv_epi8(entry, _mm_set1_epi32(i), closer);
+	}
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(best), lo);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(second), next);
+	const uint32_t bytes = (uint32_t)_mm_cvtsi128_si32(_mm_shuffle_epi8(entry, _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)));
+	std::memcpy(entries, &bytes, 4);
+}
+
+PNGSQ_TARGET("sse4.1")
+static void nearest8_sse41(struct rgb const* colours, struct rgb const* centroids, int k, unsigned char* entries, int* best, int* second) {
+	__m128i r8, g8, b8;
+	deinterleave8(colours, r8, g8, b8);
+	nearest4_sse41(r8, g8, b8, centroids, k, entries, best, second);
+	nearest4_sse41(_mm_srli_si128(r8, 4), _mm_srli_si128(g8, 4), _mm_srli_si128(b8, 4), centroids, k, entries + 4, best + 4, second + 4);
+}
+#endif // PNGSQ_X86
+
+// Runs `nearest` on 8 colours, with SIMD if available
+static void nearest8(struct rgb const* colours, struct rgb const* centroids, int k, unsigned char* entries, int* best, int* second) {
+#ifdef PNGSQ_X86
+	switch (simd_level()) {
+	case PNGSQ_SIMD_AVX2:
+		return nearest8_avx2(colours, centroids, k, entries, best, second);
+	case PNGSQ_SIMD_SSE41:
+		return nearest8_sse41(colours, centroids, k, entries, best, second);
+	}
+#endif // PNGSQ_X86
+	for (int i = 0; i < 8; i++)
+		entries[i] = (unsigned char)nearest(colours[i], centroids, k, best[i], second[i]);
+}
+
+// k-means clustering with the bounds from Hamerly (2010)
+// Each point keeps an upper bound on the distance to its own centroid and a lower bound on the distance to any other,
+// which are loosened by how far the centroids move. A point is only compared against every centroid once its bounds
+// overlap, so the assignments are the same as with Lloyd's algorithm.
+void k_means(struct rgb* centroids, int k, struct rgb const* points, uint32_t const* weights, size_t n, int iters, float tolerance) {
+	constexpr int max_k = 16;
+	// Keeps the bounds conservative despite rounding in `sqrt`
+	constexpr double slack = 1e-6;
+	constexpr double infinity = std::numeric_limits<double>::infinity();
+	auto assigned = std::make_unique<unsigned char[]>(n);
+	auto upper = std::make_unique<double[]>(n);
+	auto lower = std::make_unique<double[]>(n);
+	int64_t sums[max_k][3] = {};
+	uint64_t counts[max_k] = {};
+	double half[max_k], shift[max_k];
+	// Moves point `i` from cluster `from` to `to` in the running sums
+	auto move = [&sums, &counts, points, weights](size_t i, int from, int to) {
+		const uint64_t weight = weights != nullptr ? weights[i] : 1;
+		const struct rgb& point = points[i];
+		if (from >= 0) {
+			sums[from][0] -= (int64_t)(weight * point.r);
+			sums[from][1] -= (int64_t)(weight * point.g);
+			sums[from][2] -= (int64_t)(weight * point.b);
+			counts[from] -= weight;
+		}
+		sums[to][0] += (int64_t)(weight * point.r);
+		sums[to][1] += (int64_t)(weight * point.g);
+		sums[to][2] += (int64_t)(weight * point.b);
+		counts[to] += weight;
+	};
+	for (int iteration = 0; iteration < iters; iteration++) {
+		bool changed = false;
+		// Points whose bounds overlap are compared against every centroid 8 at a time
+		// The centroids stay put until every point has been assigned, so the order does not matter
+		size_t pending[8];
+		int count = 0;
+		auto resolve = [&]() {
+			struct rgb colours[8];
+			for (int j = 0; j < 8; j++)
+				colours[j] = points[pending[j < count ? j : 0]];
+			unsigned char entries[8];
+			int best[8], second[8];
+			nearest8(colours, centroids, k, entries, best, second);
+			for (int j = 0; j < count; j++) {
+				const size_t i = pending[j];
+				const int from = iteration > 0 ? assigned[i] : -1, entry = entries[j];
+				upper[i] = std::sqrt((double)best[j]) + slack;
+				lower[i] = k > 1 ? std::sqrt((double)second[j]) - slack : infinity;
+				if (entry == from)
+					continue;
+				assigned[i] = (unsigned char)entry;
+				move(i, from, entry);
+				changed = true;
+			}
+			count = 0;
+		};
+		for (size_t i = 0; i < n; i++) {
+			if (iteration > 0) {
+				const int from = assigned[i];
+				const double bound = std::max(half[from], lower[i]);
+				if (upper[i] < bound)
+					continue;
+				upper[i] = std::sqrt((double)dist2(points[i], centroids[from])) + slack;
+				if (upper[i] < bound)
+					continue;
+			}
+			pending[count++] = i;
+			if (count == 8)
+				resolve();
+		}
+		if (count > 0)
+			resolve();
+		if (!changed)
+			break;
+
+		int furthest = 0;
+		for (int entry = 0; entry < k; entry++) {
+			shift[entry] = 0.0;
+			if (counts[entry] == 0)
+				continue;
+			const struct rgb mean = {
+				(unsigned char)std::round((float)sums[entry][0] / counts[entry]),
+				(unsigned char)std::round((float)sums[entry][1] / counts[entry]),
+				(unsigned char)std::round((float)sums[entry][2] / counts[entry])
+			};
+			shift[entry] = std::sqrt((double)dist2(mean, centroids[entry]));
+			centroids[entry] = mean;
+			if (shift[entry] > shift[furthest])
+				furthest = entry;
+		}
+		if (shift[furthest] <= tolerance)
+			break;
+		// The lower bound only moves by the largest shift among the other centroids
+		double next = 0.0;
+		for (int entry = 0; entry < k; entry++)
+			if (entry != furthest)
+				next = std::max(next, shift[entry]);
+		for (size_t i = 0; i < n; i++) {
+			upper[i] += shift[assigned[i]] + slack;
+			lower[i] -= (assigned[i] == furthest ? next : shift[furthest]) + slack;
+		}
+		// A point nearer its centroid than half the distance to any other centroid cannot change cluster
+		for (int entry = 0; entry < k; entry++) {
+			int closest = std::numeric_limits<int>::max();
+			for (int other = 0; other < k; other++)
+				if (other != entry)
+					closest = std::min(closest, dist2(centroids[entry], centroids[other]));
+			half[entry] = k > 1 ? 0.5 * std::sqrt((double)closest) - slack : infinity;
+		}
+	}
+}
+
+uint64_t k_means_cost(struct rgb const* centroids, int k, struct rgb const* points, uint32_t const* weights, size_t n) {
+	uint64_t cost = 0;
+	for (size_t first = 0; first < n; first += 8) {
+		const size_t count = std::min(n - first, (size_t)8);
+		struct rgb colours[8];
+		for (size_t j = 0; j < 8; j++)
+			colours[j] = points[first + (j < count ? j : 0)];
+		unsigned char entries[8];
+		int best[8], second[8];
+		nearest8(colours, centroids, k, entries, best, second);
+		for (size_t j = 0; j < count; j++)
+			cost += (weights != nullptr ? weights[first + j] : 1) * (uint64_t)best[j];
+	}
+	return cost;
+}
+
+void nearest_centroids(struct rgb const* colours, size_t n, struct rgb const* centroids, int k, unsigned char* entries) {
+	for (size_t first = 0; first < n; first += 8) {
+		const size_t count = std::min(n - first, (size_t)8);
+		struct rgb block[8];
+		for (size_t j = 0; j < 8; j++)
+			block[j] = colours[first + (j < count ? j : 0)];
+		unsigned char found[8];
+		int best[8], second[8];
+		nearest8(block, centroids, k, found, best, second);
+		std::copy(found, found + count, entries + first);
+	}
+}
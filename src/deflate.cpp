@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "libdeflate/libdeflate.h"
+
+#include "deflate.hpp"
+#include "parallel.hpp"
+
+// libdeflate always marks the last block of a stream as final, so segments are joined by finding that block and
+// clearing the flag, which takes walking every block header and Huffman code before it
+// Decoding follows puff by Mark Adler, without producing any output
+namespace {
+	class bit_reader {
+	protected:
+		unsigned char const* data;
+		size_t size, pos; // `pos` counts bits
+	public:
+		bool overrun;
+
+		inline bit_reader(unsigned char const* data, size_t size) : data(data), size(size), pos(0), overrun(false) { }
+
+		inline unsigned bits(int count) {
+			unsigned value = 0;
+			for (int i = 0; i < count; i++, this->pos++) {
+				if ((this->pos >> 3) >= this->size) {
+					this->overrun = true;
+					return 0;
+				}
+				value |= (unsigned)((this->data[this->pos >> 3] >> (this->pos & 7)) & 1) << i;
+			}
+			return value;
+		}
+		inline void align(void) { this->pos = (this->pos + 7) & ~(size_t)7; }
+		inline void skip_bytes(size_t count) { this->pos += 8 * count; }
+		inline size_t position(void) const { return this->pos; }
+	};
+
+	// Canonical Huffman code: the number of codes of each length, and the symbols in code order
+	struct huffman {
+		uint16_t count[16];
+		uint16_t symbol[288];
+	};
+
+	constexpr uint8_t length_extra[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+	};
+	constexpr uint8_t distance_extra[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+	};
+}
+
+// Returns false if the lengths describe more codes than fit; incomplete codes are allowed, as for a single distance
+static bool build(struct huffman& h, uint8_t const* lengths, int n) {
+	std::fill(std::begin(h.count), std::end(h.count), (uint16_t)0);
+	for (int i = 0; i < n; i++)
+		h.count[lengths[i]]++;
+	int left = 1;
+	for (int len = 1; len < 16; len++) {
+		left = 2 * left - h.count[len];
+		if (left < 0)
+			return false;
+	}
+	uint16_t offsets[16] = { 0 };
+	for (int len = 1; len < 15; len++)
+		offsets[len + 1] = offsets[len] + h.count[len];
+	for (int i = 0; i < n; i++)
+		if (lengths[i] != 0)
+			h.symbol[offsets[lengths[i]]++] = (uint16_t)i;
+	return true;
+}
+
+// Returns the next symbol, or -1 if no code matches
+static int decode(bit_reader& in, const struct huffman& h) {
+	int code = 0, first = 0, index = 0;
+	for (int len = 1; len < 16; len++) {
+		code |= (int)in.bits(1);
+		const int count = h.count[len];
+		if (code - count < first)
+			return h.symbol[index + (code - first)];
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+// Passes over the codes of one block up to and including its end-of-block code
+static bool skip_codes(bit_reader& in, const struct huffman& lencode, const struct huffman& distcode) {
+	while (1) {
+		int symbol = decode(in, lencode);
+		if (symbol < 0 || in.overrun)
+			return false;
+		if (symbol == 256)
+			return true;
+		if (symbol < 256)
+			continue;
+		if ((symbol -= 257) >= 29)
+			return false;
+		in.bits(length_extra[symbol]);
+		if ((symbol = decode(in, distcode)) < 0 || symbol >= 30)
+			return false;
+		in.bits(distance_extra[symbol]);
+	}
+}
+
+static bool skip_dynamic(bit_reader& in) {
+	static constexpr uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	const int nlen = (int)in.bits(5) + 257, ndist = (int)in.bits(5) + 1, ncode = (int)in.bits(4) + 4;
+	if (nlen > 286 || ndist > 30)
+		return false;
+	uint8_t lengths[286 + 30] = { 0 };
+	for (int i = 0; i < ncode; i++)
+		lengths[order[i]] = (uint8_t)in.bits(3);
+	struct huffman lencode, distcode;
+	if (!build(lencode, lengths, 19))
+		return false;
+	for (int i = 0; i < nlen + ndist; ) {
+		const int symbol = decode(in, lencode);
+		if (symbol < 0 || in.overrun)
+			return false;
+		if (symbol < 16) {
+			lengths[i++] = (uint8_t)symbol;
+			continue;
+		}
+		uint8_t len = 0;
+		int repeat;
+		if (symbol == 16) {
+			if (i == 0)
+				return false;
+			len = lengths[i - 1];
+			repeat = 3 + (int)in.bits(2);
+		}
+		else if (symbol == 17)
+			repeat = 3 + (int)in.bits(3);
+		else
+			repeat = 11 + (int)in.bits(7);
+		if (i + repeat > nlen + ndist)
+			return false;
+		std::fill(lengths + i, lengths + i + repeat, len);
+		i += repeat;
+	}
+	if (lengths[256] == 0)
+		return false;
+	return build(lencode, lengths, nlen) && build(distcode, lengths + nlen, ndist) && skip_codes(in, lencode, distcode);
+}
+
+static bool skip_fixed(bit_reader& in) {
+	static const struct huffman* const codes = []() {
+		static struct huffman tables[2];
+		uint8_t lengths[288];
+		std::fill(lengths, lengths + 144, (uint8_t)8);
+		std::fill(lengths + 144, lengths + 256, (uint8_t)9);
+		std::fill(lengths + 256, lengths + 280, (uint8_t)7);
+		std::fill(lengths + 280, lengths + 288, (uint8_t)8);
+		build(tables[0], lengths, 288);
+		std::fill(lengths, lengths + 30, (uint8_t)5);
+		build(tables[1], lengths, 30);
+		return tables;
+	}();
+	return skip_codes(in, codes[0], codes[1]);
+}
+
+// Finds the bit at which the final block of a raw deflate stream starts, and the bit just past its end
+static bool find_final_block(unsigned char const* data, size_t size, size_t& final_bit, size_t& end_bit) {
+	bit_reader in(data, size);
+	while (1) {
+		const size_t start = in.position();
+		const bool last = in.bits(1);
+		bool ok;
+		switch (in.bits(2)) {
+		case 0: {
+			in.align();
+			const unsigned len = in.bits(16), nlen = in.bits(16);
+			ok = len == (~nlen & 0xffff);
+			in.skip_bytes(len);
+			break;
+		}
+		case 1:
+			ok = skip_fixed(in);
+			break;
+		case 2:
+			ok = skip_dynamic(in);
+			break;
+		default:
+			ok = false;
+		}
+		if (!ok || in.overrun || in.position() > 8 * size)
+			return false;
+		if (last) {
+			final_bit = start;
+			end_bit = in.position();
+			return true;
+		}
+	}
+}
+
+// Based on adler32_combine from zlib
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t length) {
+	constexpr uint32_t base = 65521;
+	const uint32_t rem = (uint32_t)(length % base);
+	uint32_t sum1 = first & 0xffff;
+	uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % base);
+	sum1 += (second & 0xffff) + base - 1;
+	sum2 += (first >> 16) + (second >> 16) + base - rem;
+	if (sum1 >= base)
+		sum1 -= base;
+	if (sum1 >= base)
+		sum1 -= base;
+	if (sum2 >= 2 * base)
+		sum2 -= 2 * base;
+	if (sum2 >= base)
+		sum2 -= base;
+	return sum1 | (sum2 << 16);
+}
+
+std::vector<std::vector<unsigned char>> zlib_compress_segments(unsigned char const* data, size_t size, size_t segment,
+	struct libdeflate_compressor* const* compressors, int count) {
+	count = std::max(count, 1);
+	if (segment == 0)
+		segment = (size + count - 1) / count;
+	const size_t segments = std::max((size_t)1, (size + segment - 1) / std::max(segment, (size_t)1));
+	std::vector<std::vector<unsigned char>> pieces(segments);
+	if (segments == 1) {
+		// A single segment is an ordinary zlib stream
+		pieces[0].resize(libdeflate_zlib_compress_bound(compressors[0], size));
+		const size_t length = libdeflate_zlib_compress(compressors[0], data, size, pieces[0].data(), pieces[0].size());
+		if (length == 0)
+			return {};
+		pieces[0].resize(length);
+		return pieces;
+	}
+	std::vector<uint32_t> checksums(segments);
+	std::vector<char> failed(segments, 0);
+	parallel_for(segments, count, [&](size_t first, size_t last, int thread) {
+		struct libdeflate_compressor* const compressor = compressors[thread];
+		for (size_t i = first; i < last; i++) {
+			unsigned char const* const in = data + i * segment;
+			const size_t length = std::min(segment, size - i * segment);
+			checksums[i] = libdeflate_adler32(1, in, length);
+			std::vector<unsigned char>& piece = pieces[i];
+			const size_t header = i == 0 ? 2 : 0;
+			piece.resize(header + libdeflate_deflate_compress_bound(compressor, length) + 5);
+			const size_t written = libdeflate_deflate_compress(compressor, in, length, piece.data() + header, piece.size() - header);
+			size_t final_bit = 0, end_bit = 8 * written;
+			if (written == 0 || (i + 1 < segments && !find_final_block(piece.data() + header, written, final_bit, end_bit))) {
+				failed[i] = 1;
+				continue;
+			}
+			piece.resize(header + written);
+			if (i + 1 < segments) {
+				// Clear the final flag, then end on a byte boundary with an empty stored block (3 zero header bits,
+				// padding, and lengths 0 and 0xffff)
+				unsigned char* const body = piece.data() + header;
+				body[final_bit >> 3] &= (unsigned char)~(1u << (final_bit & 7));
+				piece.resize(header + (end_bit + 3 + 7) / 8, 0);
+				piece[header + (end_bit >> 3)] &= (unsigned char)((1u << (end_bit & 7)) - 1);
+				std::fill(piece.begin() + header + (end_bit >> 3) + 1, piece.end(), (unsigned char)0);
+				piece.insert(piece.end(), { 0x00, 0x00, 0xff, 0xff });
+			}
+		}
+	});
+	if (std::find(failed.begin(), failed.end(), 1) != failed.end())
+		return {};
+	// CMF for deflate with a 32 KiB window and FLG with the default level, which is only informative
+	pieces.front()[0] = 0x78;
+	pieces.front()[1] = 0x9c;
+	uint32_t adler = checksums[0];
+	for (size_t i = 1; i < segments; i++)
+		adler = adler32_combine(adler, checksums[i], std::min(segment, size - i * segment));
+	pieces.back().insert(pieces.back().end(), {
+		(unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8), (unsigned char)adler
+	});
+	return pieces;
+}
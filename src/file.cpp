@@ -1,6 +1,8 @@
 #include <algorithm>
+#include <array>
 #include <climits>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
@@ -8,19 +10,21 @@
 #include <memory>
 #include <new>
 #include <string>
+#include <vector>
 
-#include "glad/glad.h"
 #include "libdeflate/libdeflate.h"
 
 #include "head.hpp"
 #include "buffer.hpp"
+#include "deflate.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
 
 #ifdef _WIN32
 #	define STBI_WINDOWS_UTF8
 #endif // _WIN32
 
 #include "stb_image.h"
-#include "stb_image_resize2.h"
 
 static struct image load_image_internal(char const* path) {
 	struct image img = {
@@ -63,90 +67,295 @@ bool load_image(struct image& img, char const* path) {
 	return true;
 }
 
-bool load_image_preview(struct image& img, char const* path, const struct config& cfg) {
-	struct image temp = load_image_internal(path);
-	if (temp.data_orig == nullptr)
+void free_image(struct image& img) {
+	std::free(img.data_orig);
+	std::free(img.data_dewarp);
+	std::free(img.data_index);
+	std::free(img.data_mask);
+}
+
+// Resizes `*data` to `bytes`, keeping the old block if that fails so that it is still freed later
+template <typename T>
+static bool resize_buffer(T*& data, size_t bytes) {
+	T* const temp = (T*)std::realloc(data, bytes);
+	if (temp == nullptr)
 		return false;
-	temp.path = (char*)std::malloc(std::strlen(path) + 1);
-	if (temp.path == nullptr) {
-		free_image(temp);
+	data = temp;
+	return true;
+}
+
+// (Re)allocates the dewarped image, index plane and background mask for the output size
+// The buffers are resized rather than replaced, so redoing the dewarp at the same size does not touch the allocator
+// Without `dewarp`, the dewarped image is freed instead
+bool alloc_output(struct image& img, bool dewarp) {
+	const size_t count = (size_t)img.out_width * img.out_height;
+	if (!dewarp) {
+		std::free(img.data_dewarp);
+		img.data_dewarp = nullptr;
+	}
+	if ((dewarp && !resize_buffer(img.data_dewarp, 3 * count)) || !resize_buffer(img.data_index, count)
+		|| !resize_buffer(img.data_mask, mask_stride(img.out_width) * img.out_height * sizeof(uint64_t))) {
+		std::fprintf(stderr, PNGSQ_ERROR_STRING "Failed to allocate %d x %d output\n", img.out_width, img.out_height);
 		return false;
 	}
-	std::strcpy(temp.path, path);
-	temp.dewarp_src = img.dewarp_src;
-	float scale = calc_prev_scale(temp.full_width, temp.full_height, cfg.prev_kbytes);
-	if (scale >= 1.0f) {
-		img = temp;
-		img.width = img.full_width;
-		img.height = img.full_height;
-		return true;
-	}
-	temp.width = scale * temp.full_width;
-	temp.height = scale * temp.full_height;
-	unsigned char* data = stbir_resize_uint8_srgb(
-		temp.data_orig, temp.full_width, temp.full_height, 0,
-		nullptr, temp.width, temp.height, 0,
-		STBIR_RGB);
-	std::free(temp.data_orig);
-	if (data == nullptr)
+	return true;
+}
+
+// Palette entries used by an image, and the smallest bit depth that holds them all
+struct palette_use {
+	uint8_t remap[16]; // New index of each entry; the used entries keep their order
+	uint8_t entries[16]; // Entry for each new index
+	int count, depth;
+};
+
+// Finds which palette entries `img` uses, splitting the rows across `threads` threads
+// Returns false if an index does not fit in the 16-entry palette
+static bool find_palette_use(const struct image& img, struct palette_use& use, int threads) {
+	std::vector<std::array<uint8_t, 256>> present(threads);
+	const size_t width = img.out_width;
+	const int bands = parallel_for(img.out_height, threads, [&](size_t first, size_t last, int band) {
+		uint8_t* const seen = present[band].data();
+		std::fill(seen, seen + 256, (uint8_t)0);
+		for (size_t i = first * width; i < last * width; i++)
+			seen[img.data_index[i]] = 1;
+	});
+	for (int band = 1; band < bands; band++)
+		for (int i = 0; i < 256; i++)
+			present[0][i] |= present[band][i];
+	if (std::find(present[0].begin() + 16, present[0].end(), 1) != present[0].end())
 		return false;
-	free_image(img);
-	img = temp;
-	img.data_orig = data;
-	if (cfg.prev_stage == PNGSQ_PREVIEW_ORIGINAL)
-		img.texture = create_texture(data, img.width, img.height, false);
+	use.count = 0;
+	for (int i = 0; i < 16; i++) {
+		use.remap[i] = (uint8_t)use.count;
+		if (present[0][i])
+			use.entries[use.count++] = (uint8_t)i;
+	}
+	use.depth = use.count <= 2 ? 1 : use.count <= 4 ? 2 : 4;
 	return true;
 }
 
-void free_image(struct image& img) {
-	std::free(img.data_orig);
-	std::free(img.data_dewarp);
-	std::free(img.data_output);
-	if (img.texture != 0) {
-		glDeleteTextures(1, &img.texture);
-		img.texture = 0;
+#ifdef PNGSQ_X86
+// Remaps and packs the first `pairs` rounded down to a multiple of 16 like `pack_row` at 4 bits
+// Returns the number of pairs packed
+PNGSQ_TARGET("avx2")
+static size_t pack_nibbles_avx2(unsigned char const* index, unsigned char* out, size_t pairs, uint8_t const* remap) {
+	const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(remap)));
+	// Each pair of bytes becomes 16 * first + second
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+	size_t i = 0;
+	for (; i + 16 <= pairs; i += 16) {
+		const __m256i v = _mm256_shuffle_epi8(lut, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(index + 2 * i)));
+		const __m256i packed = _mm256_packus_epi16(_mm256_maddubs_epi16(v, weights), _mm256_setzero_si256());
+		// Bytes 0-7 of each 128-bit lane hold the results
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, 0x08)));
+	}
+	return i;
+}
+
+// Same as `pack_nibbles_avx2`, 8 pairs at a time
+PNGSQ_TARGET("sse4.1")
+static size_t pack_nibbles_sse41(unsigned char const* index, unsigned char* out, size_t pairs, uint8_t const* remap) {
+	const __m128i lut = _mm_loadu_si128(reinterpret_cast<__m128i const*>(remap));
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	size_t i = 0;
+	for (; i + 8 <= pairs; i += 8) {
+		const __m128i v = _mm_shuffle_epi8(lut, _mm_loadu_si128(reinterpret_cast<__m128i const*>(index + 2 * i)));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(_mm_maddubs_epi16(v, weights), _mm_setzero_si128()));
+	}
+	return i;
+}
+
+// Remaps and packs the first `bytes` rounded down to a multiple of 4 like `pack_row` at 1 bit
+// Returns the number of bytes packed
+PNGSQ_TARGET("avx2")
+static size_t pack_bits_avx2(unsigned char const* index, unsigned char* out, size_t bytes, uint8_t const* remap) {
+	const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(remap)));
+	// The byte mask puts the first pixel of each group of 8 in the lowest bit, so each group is reversed first
+	const __m256i reverse = _mm256_setr_epi8(
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	size_t i = 0;
+	for (; i + 4 <= bytes; i += 4) {
+		const __m256i v = _mm256_shuffle_epi8(lut, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(index + 8 * i)));
+		const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_shuffle_epi8(_mm256_slli_epi16(v, 7), reverse));
+		std::memcpy(out + i, &mask, 4); // little-endian, as on every x86 CPU
+	}
+	return i;
+}
+
+// Same as `pack_bits_avx2`, 2 bytes at a time
+PNGSQ_TARGET("sse4.1")
+static size_t pack_bits_sse41(unsigned char const* index, unsigned char* out, size_t bytes, uint8_t const* remap) {
+	const __m128i lut = _mm_loadu_si128(reinterpret_cast<__m128i const*>(remap));
+	const __m128i reverse = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	size_t i = 0;
+	for (; i + 2 <= bytes; i += 2) {
+		const __m128i v = _mm_shuffle_epi8(lut, _mm_loadu_si128(reinterpret_cast<__m128i const*>(index + 8 * i)));
+		const uint16_t mask = (uint16_t)_mm_movemask_epi8(_mm_shuffle_epi8(_mm_slli_epi16(v, 7), reverse));
+		std::memcpy(out + i, &mask, 2);
+	}
+	return i;
+}
+#endif // PNGSQ_X86
+
+// Packs a row of `width` palette indices at `use.depth` bits each after remapping them, the first pixel in the highest
+// bits of each byte; every index must be below 16
+static void pack_row(unsigned char const* index, unsigned char* out, size_t width, const struct palette_use& use) {
+	const int per_byte = 8 / use.depth;
+	size_t i = 0; // Pixels packed so far, a multiple of `per_byte`
+#ifdef PNGSQ_X86
+	const int level = simd_level();
+	if (use.depth == 4 && level >= PNGSQ_SIMD_SSE41)
+		i = 2 * (level >= PNGSQ_SIMD_AVX2 ? pack_nibbles_avx2 : pack_nibbles_sse41)(index, out, width / 2, use.remap);
+	else if (use.depth == 1 && level >= PNGSQ_SIMD_SSE41)
+		i = 8 * (level >= PNGSQ_SIMD_AVX2 ? pack_bits_avx2 : pack_bits_sse41)(index, out, width / 8, use.remap);
+#endif // PNGSQ_X86
+	for (; i < width; i += per_byte) {
+		unsigned byte = 0;
+		for (int j = 0; j < per_byte; j++)
+			byte = (byte << use.depth) | (i + j < width ? use.remap[index[i + j]] : 0u);
+		out[i / per_byte] = (unsigned char)byte;
+	}
+}
+
+// Applies PNG filter `type` to the `count` bytes of row `raw`, whose previous row is `prior` (null for the first row)
+// Pixels below 8 bits are filtered a byte at a time, as if each byte were a pixel
+static void filter_row(int type, unsigned char const* raw, unsigned char const* prior, unsigned char* out, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		const int left = i > 0 ? raw[i - 1] : 0, up = prior != nullptr ? prior[i] : 0;
+		const int corner = i > 0 && prior != nullptr ? prior[i - 1] : 0;
+		int predictor = 0;
+		switch (type) {
+		case 1:
+			predictor = left;
+			break;
+		case 2:
+			predictor = up;
+			break;
+		case 3:
+			predictor = (left + up) >> 1;
+			break;
+		case 4: {
+			// Paeth (1991)
+			const int p = left + up - corner, pa = std::abs(p - left), pb = std::abs(p - up), pc = std::abs(p - corner);
+			predictor = pa <= pb && pa <= pc ? left : pb <= pc ? up : corner;
+			break;
+		}
+		}
+		out[i] = (unsigned char)(raw[i] - predictor);
 	}
 }
 
-static inline struct rgb& px_from_coord(const struct image& img, int x, int y) {
-	return *bytes_to_rgb(&img.data_output[(y * (size_t)img.out_width + x) * 3]);
+// Chooses a filter for each row of `raw` (rows of `length` bytes, filter byte first) and writes the result to `out`
+// PNGSQ_FILTER_HEURISTIC takes the filter with the smallest sum of absolute values as signed bytes, as libpng does;
+// PNGSQ_FILTER_TRIAL compresses every candidate after the same few previous filtered rows and takes the smallest, with
+// ties going to no filter
+// Bands of rows are split across the compressors' threads, each band starting without previous filtered rows
+static void filter_rows(unsigned char const* raw, unsigned char* out, size_t length, size_t rows, int mode,
+	struct libdeflate_compressor* const* compressors, int threads) {
+	// Rows of context for a trial; a single row says too little about what the compressor can match against
+	constexpr size_t window = 4;
+	const size_t count = length - 1;
+	parallel_for(rows, threads, [&](size_t first, size_t last, int thread) {
+		struct libdeflate_compressor* const compressor = compressors[thread];
+		auto candidates = std::make_unique<unsigned char[]>(5 * length);
+		std::vector<unsigned char> trial, scratch;
+		if (mode == PNGSQ_FILTER_TRIAL) {
+			trial.resize((window + 1) * length);
+			scratch.resize(libdeflate_deflate_compress_bound(compressor, trial.size()));
+		}
+		for (size_t row = first; row < last; row++) {
+			unsigned char const* const line = raw + row * length + 1;
+			unsigned char const* const prior = row > 0 ? line - length : nullptr;
+			// Filtered rows are contiguous in `out`, so the context is a single copy shared by every candidate
+			const size_t context = mode == PNGSQ_FILTER_TRIAL ? std::min(row - first, window) * length : 0;
+			if (context != 0)
+				std::memcpy(trial.data(), out + row * length - context, context);
+			size_t best_cost = SIZE_MAX;
+			int best = 0;
+			for (int type = 0; type < 5; type++) {
+				unsigned char* const candidate = &candidates[type * length];
+				candidate[0] = (unsigned char)type;
+				filter_row(type, line, prior, candidate + 1, count);
+				size_t cost = 0;
+				if (mode == PNGSQ_FILTER_TRIAL) {
+					std::memcpy(trial.data() + context, candidate, length);
+					cost = libdeflate_deflate_compress(compressor, trial.data(), context + length, scratch.data(), scratch.size());
+				}
+				else {
+					for (size_t i = 1; i < length; i++)
+						cost += (size_t)std::abs((int)(signed char)candidate[i]);
+				}
+				if (cost < best_cost) {
+					best_cost = cost;
+					best = type;
+				}
+			}
+			std::memcpy(out + row * length, &candidates[best * length], length);
+		}
+	});
 }
 
-static void put_scanlines(const struct image& img, buffer& buf, struct libdeflate_compressor* compressor) {
-	unsigned char* data = img.data_output;
-	struct rgb const* const end = img.palette + sizeof(img.palette) / sizeof(img.palette[0]);
-	const bool odd = img.out_width % 2;
-	const int count = img.out_width - (int)odd;
-	const size_t length = (img.out_width + (size_t)odd) / 2 + 1;
+// Filters and compresses the index plane, packed at `use.depth` bits per pixel, into a zlib stream made of one piece
+// per segment of rows
+static bool put_scanlines(const struct image& img, const struct palette_use& use, std::vector<std::vector<unsigned char>>& pieces,
+	struct libdeflate_compressor* const* compressors, const struct config& cfg) {
+	const size_t length = ((size_t)img.out_width * use.depth + 7) / 8 + 1;
 	const size_t bytes = img.out_height * length;
 	auto lines = std::make_unique<unsigned char[]>(bytes);
 	for (int line = 0; line < img.out_height; line++) {
-		lines[line * length] = 0;
-		for (int i = 0; i < count; i += 2) {
-			unsigned char p1 = (unsigned char)(std::find(img.palette, end, px_from_coord(img, i, line)) - img.palette);
-			unsigned char p2 = (unsigned char)(std::find(img.palette, end, px_from_coord(img, i + 1, line)) - img.palette);
-#ifdef _MSC_VER
-#	pragma warning(push)
-#	pragma warning(disable: 6386)
-#endif // _MSC_VER
-			lines[i / 2 + line * length + 1] = (p1 << 4) | p2;
-#ifdef _MSC_VER
-#	pragma warning(pop)
-#endif // _MSC_VER
-		}
-		if (odd) {
-			unsigned char p1 = (unsigned char)(std::find(img.palette, end, px_from_coord(img, count, line)) - img.palette);
-			lines[count / 2 + line * length + 1] = p1 << 4;
+		unsigned char* const out = &lines[line * length];
+		out[0] = 0;
+		pack_row(img.data_index + (size_t)img.out_width * line, out + 1, img.out_width, use);
+	}
+	const int threads = thread_count(cfg.threads);
+	// Segments hold whole rows, so that they line up with the filter bytes
+	const size_t rows = cfg.segment > 0
+		? std::max((size_t)1, ((size_t)cfg.segment * 1024 + length / 2) / length)
+		: ((size_t)img.out_height + threads - 1) / threads;
+	if (cfg.filter == PNGSQ_FILTER_NONE)
+		pieces = zlib_compress_segments(lines.get(), bytes, rows * length, compressors, threads);
+	else {
+		auto filtered = std::make_unique<unsigned char[]>(bytes);
+		filter_rows(lines.get(), filtered.get(), length, img.out_height, cfg.filter, compressors, threads);
+		pieces = zlib_compress_segments(filtered.get(), bytes, rows * length, compressors, threads);
+		if (cfg.filter == PNGSQ_FILTER_TRIAL && !pieces.empty()) {
+			// Trials only see a few rows at a time, so the whole image is also tried without filters, which means a
+			// trial never comes out larger than no filtering at the same level
+			std::vector<std::vector<unsigned char>> plain = zlib_compress_segments(lines.get(), bytes, rows * length, compressors, threads);
+			const auto total = [](const std::vector<std::vector<unsigned char>>& stream) {
+				size_t size = 0;
+				for (const std::vector<unsigned char>& piece: stream)
+					size += piece.size();
+				return size;
+			};
+			if (!plain.empty() && total(plain) <= total(pieces))
+				pieces = std::move(plain);
 		}
 	}
-	size_t max_size = bytes + 5 * ((size_t)std::floor(bytes / 16383.0) + 1) + 6;
-	buf.alloc(max_size + 4);
-	buf.alloc(libdeflate_zlib_compress(compressor, lines.get(), bytes, buf.data() + 4, buf.size()) + 4); // Shrink the buffer
+	if (pieces.empty())
+		std::fprintf(stderr, PNGSQ_ERROR_STRING "Compression failed\n");
+	return !pieces.empty();
 }
 
 // For correct byte ordering
 #define U32_TO_8(x) { (char)((x) >> 24), (char)(((x) >> 16) & 0xff), (char)(((x) >> 8) & 0xff), (char)((x) & 0xff) }
 
+// Writes `size` bytes of data as chunks of type `type`, split so that no chunk exceeds the length limit
+static void write_chunks(std::ofstream& out, char const* type, unsigned char const* data, size_t size) {
+	constexpr size_t limit = (size_t)1 << 30;
+	for (size_t pos = 0; pos < size; pos += limit) {
+		const uint32_t length = (uint32_t)std::min(limit, size - pos);
+		const uint32_t crc = libdeflate_crc32(libdeflate_crc32(0, type, 4), data + pos, length);
+		char size_bytes[4] = U32_TO_8(length);
+		char crc_bytes[4] = U32_TO_8(crc);
+		out.write(size_bytes, 4);
+		out.write(type, 4);
+		out.write(reinterpret_cast<char const*>(data + pos), length);
+		out.write(crc_bytes, 4);
+	}
+}
+
 static inline void write_chunk(std::ofstream& out, const buffer& buf) {
 	if (buf.size() < 4)
 		return;
@@ -163,7 +372,21 @@ static inline void write_chunk(std::ofstream& out, const buffer& buf) {
 extern "C" int __stdcall MultiByteToWideChar(unsigned int cp, unsigned long flags, const char* str, int cbmb, wchar_t* widestr, int cchwide);
 #endif // defined(_WIN32) && defined(_MSC_VER)
 
-bool write_image(const struct image& img, char const* path, struct libdeflate_compressor* compressor) {
+bool write_image(const struct image& img, char const* path, struct libdeflate_compressor* const* compressors, const struct config& cfg) {
+	// The image data is compressed before the file is opened, so that nothing is written if it cannot be encoded
+	struct palette_use use;
+	if (!find_palette_use(img, use, thread_count(cfg.threads))) {
+		std::fprintf(stderr, PNGSQ_ERROR_STRING "Palette index out of range\n");
+		return false;
+	}
+	std::vector<std::vector<unsigned char>> idat;
+	try {
+		if (!put_scanlines(img, use, idat, compressors, cfg))
+			return false;
+	}
+	catch (std::bad_alloc& e) {
+		return false;
+	}
 	buffer buf;
 #ifdef _WIN32
 	if (std::strlen(path) > INT_MAX)
@@ -183,22 +406,20 @@ bool write_image(const struct image& img, char const* path, struct libdeflate_co
 		buf.put("\x49\x48\x44\x52", 4);
 		buf.put((uint32_t)img.out_width);
 		buf.put((uint32_t)img.out_height);
-		buf.put("\4\3\0\0\0", 5); // Bit depth 4, colour type 3, compression method 0, filter method 0, interlace method 0
+		buf.put((char)use.depth);
+		buf.put("\3\0\0\0", 4); // Colour type 3, compression method 0, filter method 0, interlace method 0
 		write_chunk(out, buf);
 		buf.free();
-		// PLTE
-		buf.alloc(52);
+		// PLTE, with only the entries in use
+		buf.alloc(4 + 3 * (size_t)use.count);
 		buf.put("\x50\x4c\x54\x45", 4);
-		for (int i = 0; i < 16; i++)
-			buf.put(reinterpret_cast<char const*>(&img.palette[i]), 3);
-		write_chunk(out, buf);
-		buf.free();
-		// IDAT
-		buf.alloc(4);
-		buf.put("\x49\x44\x41\x54", 4);
-		put_scanlines(img, buf, compressor);
+		for (int i = 0; i < use.count; i++)
+			buf.put(reinterpret_cast<char const*>(&img.palette[use.entries[i]]), 3);
 		write_chunk(out, buf);
 		buf.free();
+		// IDAT, one or more per segment
+		for (const std::vector<unsigned char>& piece: idat)
+			write_chunks(out, "\x49\x44\x41\x54", piece.data(), piece.size());
 		// IEND
 		buf.alloc(4);
 		buf.put("\x49\x45\x4e\x44", 4);
@@ -301,10 +301,36 @@ static void window_file(struct image& img, struct wndinfo& wnd, struct config& c
 static void window_processing(struct image& img, struct config& cfg) {
 	if (ImGui::Begin("Processing")) {
 		static float palette[45] = { 0.0f };
+		{
+			static char const* const options[] = {
+				"Sample pixels",
+				"Every pixel, counted by colour"
+			};
+			ImGui::TextUnformatted("Colours clustered");
+			ImGui::SetNextItemWidth(-FLT_MIN);
+			ImGui::Combo("##cluster", &cfg.cluster, options, sizeof(options) / sizeof(options[0]));
+		}
+		ImGui::BeginDisabled(cfg.cluster != PNGSQ_CLUSTER_SAMPLE);
 		ImGui::TextUnformatted("Number of colours sampled");
 		ImGui::InputInt("##sampled", &cfg.sampled, 0);
+		ImGui::EndDisabled();
+		{
+			static char const* const options[] = {
+				"k-means++",
+				"k-means|| (faster for large samples)"
+			};
+			ImGui::TextUnformatted("Initial palette");
+			ImGui::SetNextItemWidth(-FLT_MIN);
+			ImGui::Combo("##seeding", &cfg.seeding, options, sizeof(options) / sizeof(options[0]));
+		}
+		ImGui::TextUnformatted("Clustering trials (best palette is kept)");
+		ImGui::InputInt("##trials", &cfg.trials, 0);
 		ImGui::TextUnformatted("Maximum number of k-means iterations");
 		ImGui::InputInt("##iters", &cfg.iters, 0);
+		ImGui::TextUnformatted("k-means tolerance");
+		ImGui::InputFloat("##tolerance", &cfg.tolerance, 0.0f, 0.0f, "%.2f");
+		ImGui::TextUnformatted("Threads (0 for one per core)");
+		ImGui::InputInt("##threads", &cfg.threads, 0);
 
 		if (ImGui::CollapsingHeader("Palette", ImGuiTreeNodeFlags_DefaultOpen) && ImGui::BeginTable("palette", 2, table_flags)) {
 			ImGui::TableSetupColumn("#", ImGuiTableColumnFlags_WidthFixed, ImGui::CalcTextSize("14").x);
@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include "histogram.hpp"
+#include "parallel.hpp"
+
+void histogram::add(struct rgb const* pixels, size_t count) {
+	uint32_t* const counts = this->counts.get();
+	for (size_t i = 0; i < count; i++)
+		counts[bin(pixels[i])]++;
+}
+
+void histogram::merge(const histogram& other) {
+	for (size_t i = 0; i < bins; i++)
+		this->counts[i] += other.counts[i];
+}
+
+void histogram::clear(void) {
+	std::memset(this->counts.get(), 0, bins * sizeof(uint32_t));
+}
+
+struct rgb histogram::mode(struct rgb const* pixels, size_t count, int threads) const {
+	constexpr unsigned shift = 8 - bits;
+	constexpr uint_fast32_t mask = (1 << shift) - 1;
+	constexpr size_t exact = (size_t)1 << (3 * shift); // colours per bin
+	// Bins from fullest to emptiest; ties are broken by bin number so that the result is deterministic
+	auto order = std::make_unique<uint_fast32_t[]>(bins);
+	std::iota(order.get(), order.get() + bins, 0);
+	std::stable_sort(order.get(), order.get() + bins, [this](uint_fast32_t left, uint_fast32_t right) { return this->counts[left] > this->counts[right]; });
+	auto slots = std::make_unique<int32_t[]>(bins);
+	struct rgb best = { 0, 0, 0 };
+	uint32_t best_count = 0;
+	// Count the exact colours of the fullest bins, doubling the number of bins refined per pass until no unrefined
+	// bin can hold a colour more common than the best one so far
+	for (size_t first = 0, batch = 8; first < bins && this->counts[order[first]] > best_count; first += batch, batch *= 2) {
+		const size_t last = std::min(first + batch, bins);
+		std::fill(slots.get(), slots.get() + bins, -1);
+		for (size_t i = first; i < last; i++)
+			slots[order[i]] = (int32_t)(i - first);
+		const size_t size = (last - first) * exact;
+		std::vector<std::unique_ptr<uint32_t[]>> partial(threads);
+		threads = parallel_for(count, threads, [&](size_t begin, size_t end, int thread) {
+			uint32_t* const counts = (partial[thread] = std::make_unique<uint32_t[]>(size)).get();
+			for (size_t i = begin; i < end; i++) {
+				const struct rgb& px = pixels[i];
+				const int32_t slot = slots[bin(px)];
+				if (slot >= 0)
+					counts[slot * exact + (((px.r & mask) << (2 * shift)) | ((px.g & mask) << shift) | (px.b & mask))]++;
+			}
+		});
+		uint32_t* const counts = partial[0].get();
+		for (int thread = 1; thread < threads; thread++)
+			for (size_t i = 0; i < size; i++)
+				counts[i] += partial[thread][i];
+		for (size_t i = 0; i < size; i++) {
+			if (counts[i] <= best_count)
+				continue;
+			const uint_fast32_t b = order[first + i / exact], low = i % exact;
+			best_count = counts[i];
+			best.r = (unsigned char)(((b >> (2 * bits)) << shift) | (low >> (2 * shift)));
+			best.g = (unsigned char)((((b >> bits) & ((1 << bits) - 1)) << shift) | ((low >> shift) & mask));
+			best.b = (unsigned char)(((b & ((1 << bits) - 1)) << shift) | (low & mask));
+		}
+	}
+	return best;
+}
@@ -1,269 +1,367 @@
 #include <algorithm>
-#include <cfloat>
+#include <array>
+#include <bit>
 #include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
-#include <functional>
-#include <map>
 #include <memory>
 #include <vector>
 
 #include "head.hpp"
+#include "classify.hpp"
+#include "cluster.hpp"
+#include "histogram.hpp"
+#include "palette.hpp"
+#include "parallel.hpp"
 #include "random.hpp"
+#include "simd.hpp"
+#include "warp.hpp"
 
-static struct hsv to_hsv(unsigned char r, unsigned char g, unsigned char b) {
-	float _r = r / 255.0f, _g = g / 255.0f, _b = b / 255.0f;
-	float v = std::max({_r, _g, _b});
-	float d = v - std::min({_r, _g, _b});
-	float s = v ? (d / v) : 0.0f;
-	float h = 0.0f;
-	if (d <= 0.0f) return { h, s, v };
-	else if (v == _r) h = (_g - _b) / d + 0.0f;
-	else if (v == _g) h = (_b - _r) / d + 2.0f;
-	else if (v == _b) h = (_r - _g) / d + 4.0f;
-	if (h < 0.0f) h += 6.0f;
-	h *= 60.0f;
-	return { h, s, v };
+// Returns the most common colour of the dewarped image, unless the configuration overrides it
+static struct rgb find_background(const struct image& img, const struct config& cfg, int threads) {
+	if (cfg.ovr_bg_before)
+		return cfg.ovr_bg_before_col;
+	const size_t width = img.out_width, count = width * img.out_height;
+	struct rgb const* const src = bytes_to_rgb(img.data_dewarp, count);
+	// One histogram per band of rows, merged afterwards
+	std::vector<histogram> hists(threads);
+	const int bands = parallel_for(img.out_height, threads, [&](size_t first, size_t last, int band) {
+		hists[band].add(src + first * width, (last - first) * width);
+	});
+	for (int band = 1; band < bands; band++)
+		hists[0].merge(hists[band]);
+	return hists[0].mode(src, count, threads);
 }
 
-static struct hsv hsv_diff(const struct hsv& x, const struct hsv& y) {
-	float h = std::abs(x.h - y.h);
-	float s = std::abs(x.s - y.s);
-	float v = std::abs(x.v - y.v);
-	return { std::min(h, 360.0f - h), s, v };
+// Returns this thread's background table, compiled for `background`
+// Kept between calls so that colours only need to be tested again when the background or thresholds change
+// Workers must use the table through the returned reference, as naming the thread_local there refers to their own
+static bg_table& background_table(const std::vector<struct threshold>& thrs, const struct rgb& background, bool dark) {
+	thread_local bg_table cache;
+	cache.compile(thrs, background, dark);
+	return cache;
 }
 
-void make_background(struct image& img, const std::vector<struct threshold>& thrs, const struct config& cfg) {
-	const size_t size = (size_t)3 * img.out_width * img.out_height;
-	std::memcpy(img.data_output, img.data_dewarp, size);
-	unsigned char* data = img.data_output;
-	unsigned char r = 0, g = 0, b = 0;
-	if (cfg.ovr_bg_before) {
-		r = cfg.ovr_bg_before_col.r;
-		g = cfg.ovr_bg_before_col.g;
-		b = cfg.ovr_bg_before_col.b;
-	}
-	else {
-		std::map<uint_fast32_t, size_t> counts;
-		size_t max = 0;
-		for (size_t i = 0; i < size; i += 3) {
-#ifdef _MSC_VER
-#	pragma warning(push)
-#	pragma warning(disable: 6385)
-#endif // _MSC_VER
-			size_t count = ++counts[((uint_fast32_t)data[i + 2] << 16) | ((uint_fast32_t)data[i + 1] << 8) | data[i]];
-#ifdef _MSC_VER
-#	pragma warning(pop)
-#endif // _MSC_VER
-			if (count > max) {
-				max = count;
-				r = data[i + 0];
-				g = data[i + 1];
-				b = data[i + 2];
-			}
+// Returns the mask word for `count` (at most 64) pixels, with the bits past `count` set as padding
+// Pixels that already have the replacement colour are background as well
+static inline uint64_t background_bits(bg_table& table, struct rgb const* pixels, size_t count, const struct rgb& replacement) {
+	uint64_t bits = count < 64 ? ~(uint64_t)0 << count : 0;
+	for (size_t i = 0; i < count; i++)
+		bits |= (uint64_t)(table.test(pixels[i]) || pixels[i] == replacement) << i;
+	return bits;
+}
+
+// Fills in the background mask of `img` and clears its indices, splitting the rows across `threads` threads
+static void classify(struct image& img, bg_table& table, const struct rgb& replacement, int threads) {
+	const size_t width = img.out_width, stride = mask_stride(img.out_width);
+	struct rgb const* const src = bytes_to_rgb(img.data_dewarp, width * img.out_height);
+	parallel_for(img.out_height, threads, [&](size_t first, size_t last, int) {
+		for (size_t y = first; y < last; y++) {
+			struct rgb const* const row = src + y * width;
+			uint64_t* const mask = img.data_mask + y * stride;
+			table.resolve(row, width);
+			for (size_t word = 0; word < stride; word++)
+				mask[word] = background_bits(table, row + word * 64, std::min((size_t)64, width - word * 64), replacement);
+			std::memset(img.data_index + y * width, 0, width);
 		}
+	});
+}
+
+void make_background(struct image& img, const std::vector<struct threshold>& thrs, const struct config& cfg) {
+	const int threads = thread_count(cfg.threads);
+	const struct rgb background = find_background(img, cfg, threads);
+	const struct rgb replacement = cfg.ovr_bg_after ? cfg.ovr_bg_after_col : background;
+	classify(img, background_table(thrs, background, cfg.dark), replacement, threads);
+	img.palette[0] = replacement;
+}
+
+// Generates a random floating-point number on (0, 1)
+static inline float random_unit(rand_gen& rng) {
+	return (rng.next32() + 1.0f) / (UINT32_MAX + 2.0f);
+}
+
+// Walks the pixels that are not background in row-major order, using the background mask to skip whole words
+class fg_cursor {
+protected:
+	struct rgb const* pixels;
+	uint64_t const* mask;
+	size_t width, stride, word, words;
+	uint64_t bits; // Foreground pixels of `word` that have not been passed yet
+public:
+	inline fg_cursor(const struct image& img);
+
+	// Passes over `skip` foreground pixels and returns the next one, or null once there are none left
+	inline struct rgb const* advance(size_t skip = 0);
+};
+
+inline fg_cursor::fg_cursor(const struct image& img) :
+	pixels(bytes_to_rgb(img.data_dewarp, (size_t)img.out_width * img.out_height)), mask(img.data_mask),
+	width(img.out_width), stride(mask_stride(img.out_width)), word(0), words(mask_stride(img.out_width) * img.out_height),
+	bits(words > 0 ? ~img.data_mask[0] : 0) {}
+
+inline struct rgb const* fg_cursor::advance(size_t skip) {
+	for (size_t count; (count = std::popcount(this->bits)) <= skip; this->bits = ~this->mask[this->word]) {
+		skip -= count;
+		if (++this->word >= this->words)
+			return nullptr;
 	}
-	const struct hsv background = to_hsv(r, g, b);
-	for (size_t i = 0; i < size; i += 3) {
-		const struct hsv pixel = to_hsv(data[i], data[i + 1], data[i + 2]);
-		const struct hsv diff = hsv_diff(pixel, background);
-		for (const struct threshold& thr: thrs) {
-			if (diff.h > thr.diff.h || diff.s > thr.diff.s || (!thr.mode && diff.v > thr.diff.v))
-				continue;
-			else if (thr.mode && !cfg.dark && pixel.v < background.v - thr.diff.v)
-				continue;
-			else if (thr.mode && cfg.dark && pixel.v > background.v + thr.diff.v)
-				continue;
-			if (cfg.ovr_bg_after) {
-				data[i + 0] = cfg.ovr_bg_after_col.r;
-				data[i + 1] = cfg.ovr_bg_after_col.g;
-				data[i + 2] = cfg.ovr_bg_after_col.b;
-				break;
-			}
-			else {
-				data[i + 0] = r;
-				data[i + 1] = g;
-				data[i + 2] = b;
-				break;
+	for (; skip > 0; skip--)
+		this->bits &= this->bits - 1;
+	const size_t x = (this->word % this->stride) * 64 + std::countr_zero(this->bits);
+	this->bits &= this->bits - 1;
+	return this->pixels + (this->word / this->stride) * this->width + x;
+}
+
+// Calls `func(index, colour)` for every pixel in rows [first, last) that is not background
+template<typename F>
+static inline void for_each_foreground(const struct image& img, size_t first, size_t last, F&& func) {
+	struct rgb const* const pxs = bytes_to_rgb(img.data_dewarp, (size_t)img.out_width * img.out_height);
+	const size_t width = img.out_width, stride = mask_stride(img.out_width);
+	for (size_t y = first; y < last; y++) {
+		uint64_t const* const mask = img.data_mask + y * stride;
+		for (size_t word = 0; word < stride; word++) {
+			for (uint64_t bits = ~mask[word]; bits != 0; bits &= bits - 1) {
+				const size_t index = y * width + word * 64 + std::countr_zero(bits);
+				func(index, pxs[index]);
 			}
 		}
 	}
-	img.palette[0] = cfg.ovr_bg_after ? cfg.ovr_bg_after_col : rgb { r, g, b };
-}
-
-// Generates a random floating-point number on (0, 1)
-static inline float random(void) {
-	return (mix32_rand() + 1.0f) / (UINT32_MAX + 2.0f);
 }
 
-static inline std::function<float(float)> beta_func(const float alpha, const float beta) {
-	return [alpha, beta](float x) -> float {
-		// Use `lgamma` with `exp` as `tgamma` will overflow
-		return std::powf(x, alpha - 1) * std::powf(1 - x, beta - 1)
-			* std::expf(std::lgammaf(alpha + beta) - std::lgammaf(alpha) - std::lgammaf(beta));
-	};
+// Returns the number of pixels that are not background
+static size_t count_foreground(const struct image& img) {
+	const size_t words = mask_stride(img.out_width) * img.out_height;
+	size_t count = 0;
+	for (size_t i = 0; i < words; i++)
+		count += std::popcount(~img.data_mask[i]);
+	return count;
 }
 
 // Reservoir sampling, based on Algorithm M from Li (1994)
-static inline void res_sample(struct rgb** sample, int n, struct rgb* const* colours, size_t size) {
+void res_sample(struct rgb* sample, int n, const struct image& img, rand_gen& rng) {
 	const int64_t r = (int64_t)(2.07 * std::sqrt(n));
 	const int64_t c = (int64_t)std::floor(10.5 * (3.14245 + r) / std::log((n + r) / (n - 1.0)) - n);
-	std::memcpy(sample, colours, n * sizeof(struct rgb*));
-	float w = 0.0f, t = 0.0f, u = random();
-	size_t index = n;
-	for (const size_t end = n + c; index < end; index++) {
-		if (index >= size)
+	fg_cursor cursor(img);
+	for (int i = 0; i < n; i++)
+		sample[i] = *cursor.advance();
+	float t = 0.0f, u = random_unit(rng);
+	struct rgb const* px;
+	for (int64_t i = n; i < n + c; i++) {
+		if ((px = cursor.advance()) == nullptr)
 			return;
 		u *= 1.0f + (float)n / ++t;
 		if (u >= 1.0) {
-			sample[mix32_rand(n)] = colours[index];
-			u = random();
+			sample[rng.next32(n)] = *px;
+			u = random_unit(rng);
 		}
 	}
-	w = mix32_rand_pdf((n - 1.0f) / (n + c - 1.0f), beta_func((float)n, c + 1.0f));
+	// The weight shrinks with every round, so it stays in double and goes through log1p: in float, 1 - w rounds to 1
+	// once w is below about 6e-8, and the skip would come out infinite
+	double w = rng.beta_variate(n, c + 1.0);
 	while (1) {
-		float q = std::logf(1.0f - w);
-		int64_t s = (int64_t)std::floor(std::logf(u) / q);
-		index += s + 1;
-		if (index >= size)
+		const double q = std::log1p(-w);
+		// Passes over as many pixels as the weight says to skip, and returns null if that is past the end of the image
+		const auto skip = [&](float v) -> struct rgb const* {
+			const double s = std::floor(std::log(v) / q);
+			return q < 0.0 && s < (double)INT64_MAX ? cursor.advance((size_t)s) : nullptr;
+		};
+		if ((px = skip(u)) == nullptr)
 			return;
-		sample[mix32_rand(n)] = colours[index];
+		sample[rng.next32(n)] = *px;
 		t = 0.0f;
-		u = random();
+		u = random_unit(rng);
 		for (int64_t i = 0; i < r; i++) {
-			s = (int64_t)std::floor(std::logf(random()) / q);
-			index += s + 1;
-			if (index >= size)
+			if ((px = skip(random_unit(rng))) == nullptr)
 				return;
 			u *= 1.0f + n / ++t;
 			if (u >= 1.0f) {
-				sample[mix32_rand(n)] = colours[index];
-				u = random();
+				sample[rng.next32(n)] = *px;
+				u = random_unit(rng);
 			}
 		}
-		w *= mix32_rand_pdf((n - 1.0f) / (n + r - 1.0f), beta_func((float)n, r + 1.0f));
+		w *= rng.beta_variate(n, r + 1.0);
 	}
 }
 
-static constexpr float dist2(const struct rgb& left, const struct rgb& right) {
-	const float dr = left.r - right.r, dg = left.g - right.g, db = left.b - right.b;
-	return dr * dr + dg * dg + db * db;
-}
-
-// k-means++, based on Arthur and Vassilvitskii (2007)
-static inline void k_means_pp(struct image& img, struct rgb** sample, int n) {
-	auto distances = std::make_unique<float[]>(n);
-	std::memset(distances.get(), 1, n * sizeof(float)); // fill with any nonzero values (can be junk)
-	img.palette[1] = *sample[mix32_rand(n)];
-	for (int entry = 2; entry < 16; entry++) {
-		float total = 0.0;
-		for (int i = 0; i < n; i++) {
-			if (distances[i] == 0.0)
-				continue;
-			distances[i] = dist2(*sample[i], img.palette[entry - 1]);
-			total += distances[i];
+// Sets `index` to the nearest entry of `img.palette` for each of `count` (at most 64) `pixels` whose bit in
+// `background` is clear, leaving the rest as they are
+// Most pixels are resolved by their cell in `map`; with SIMD, the rest are gathered and compared against the whole
+// palette 8 at a time, which is faster than going through the few candidates of each one
+static void map_word(const struct image& img, const palette_map& map, struct rgb const* pixels, size_t count,
+	uint64_t background, unsigned char* index) {
+	const uint64_t foreground = ~background & (count < 64 ? ((uint64_t)1 << count) - 1 : ~(uint64_t)0);
+	if (simd_level() == PNGSQ_SIMD_NONE) {
+		for (uint64_t bits = foreground; bits != 0; bits &= bits - 1) {
+			const int i = std::countr_zero(bits);
+			index[i] = map.nearest(pixels[i]);
 		}
-		int index = 0;
-		if (total != 0.0)
-			while (distances[index = (int)mix32_rand(n, distances.get(), total)] == 0);
-		img.palette[entry] = *sample[index];
+		return;
 	}
+	struct rgb pending[64];
+	unsigned char where[64], found[64];
+	size_t n = 0;
+	for (uint64_t bits = foreground; bits != 0; bits &= bits - 1) {
+		const int i = std::countr_zero(bits);
+		const int entry = map.unique(pixels[i]);
+		if (entry >= 0)
+			index[i] = (unsigned char)entry;
+		else {
+			pending[n] = pixels[i];
+			where[n++] = (unsigned char)i;
+		}
+	}
+	if (n != 0)
+		nearest_centroids(pending, n, img.palette, 16, found);
+	for (size_t i = 0; i < n; i++)
+		index[where[i]] = found[i];
 }
 
-// k-means clustering
-static inline void k_means(struct image& img, struct rgb** sample, int n, const struct config& cfg) {
-	auto means = std::make_unique<unsigned char[]>(n);
-	bool changed = true;
-	for (int iterations = 0; iterations < cfg.iters && changed; iterations++) {
-		changed = false;
-		for (int i = 0; i < n; i++) {
-			float best = FLT_MAX;
-			for (int entry = 1; entry < 16; entry++) {
-				float dist = dist2(*sample[i], img.palette[entry]);
-				if (best > dist) {
-					best = dist;
-					if (means[i] == entry)
-						continue;
-					changed = true;
-					means[i] = entry;
-				}
-			}
-		}
-		for (int entry = 1; entry < 16; entry++) {
-			uint64_t r_sum = 0, g_sum = 0, b_sum = 0, count = 0;
-			for (size_t i = 0; i < n; i++) {
-				if (means[i] == entry) {
-					r_sum += sample[i]->r;
-					g_sum += sample[i]->g;
-					b_sum += sample[i]->b;
-					count++;
-				}
-			}
-			if (count == 0)
-				continue;
-			img.palette[entry].r = (unsigned char)std::roundf((float)r_sum / count);
-			img.palette[entry].g = (unsigned char)std::roundf((float)g_sum / count);
-			img.palette[entry].b = (unsigned char)std::roundf((float)b_sum / count);
-		}
+// Sets the index of each foreground pixel to its nearest palette entry, splitting the rows across `threads` threads
+static void map_foreground(struct image& img, int threads) {
+	// Kept between calls so that pages sharing a palette only build it once
+	// Workers must use this thread's map through a reference, as naming `map` there refers to their own
+	thread_local palette_map cache;
+	const palette_map& map = cache;
+	cache.build(img.palette);
+	struct rgb const* const pxs = bytes_to_rgb(img.data_dewarp, (size_t)img.out_width * img.out_height);
+	const size_t width = img.out_width, stride = mask_stride(img.out_width);
+	parallel_for(img.out_height, threads, [&](size_t first, size_t last, int) {
+		for (size_t y = first; y < last; y++)
+			for (size_t word = 0; word < stride; word++)
+				map_word(img, map, pxs + y * width + word * 64, std::min((size_t)64, width - word * 64),
+					img.data_mask[y * stride + word], img.data_index + y * width + word * 64);
+	});
+}
+
+// Counts the foreground of `img` with 6 bits per channel and returns the mean colour of every bin in use along with
+// its count
+// Scanned pages have far fewer distinct colours than pixels, so every pixel can be clustered this way
+static void colour_counts(const struct image& img, std::vector<struct rgb>& points, std::vector<uint32_t>& weights) {
+	constexpr unsigned bits = 6;
+	constexpr size_t bins = (size_t)1 << (3 * bits);
+	auto counts = std::make_unique<uint32_t[]>(bins);
+	auto sums = std::make_unique<uint64_t[][3]>(bins);
+	for_each_foreground(img, 0, img.out_height, [&](size_t, const struct rgb& px) {
+		const size_t bin = colour_bin<bits>(px);
+		counts[bin]++;
+		sums[bin][0] += px.r;
+		sums[bin][1] += px.g;
+		sums[bin][2] += px.b;
+	});
+	for (size_t bin = 0; bin < bins; bin++) {
+		const uint32_t count = counts[bin];
+		if (count == 0)
+			continue;
+		points.push_back({
+			(unsigned char)((sums[bin][0] + count / 2) / count),
+			(unsigned char)((sums[bin][1] + count / 2) / count),
+			(unsigned char)((sums[bin][2] + count / 2) / count)
+		});
+		weights.push_back(count);
 	}
 }
 
-void make_palette(struct image& img, const struct config& cfg) {
-	size_t size = (size_t)img.out_width * (size_t)img.out_height;
-	struct rgb* pxs = bytes_to_rgb(img.data_output, size);
-	std::vector<struct rgb*> foreground;
-	for (size_t i = 0; i < size; i++) {
-		struct rgb* colour = &pxs[i];
-		if (*colour != img.palette[0])
-			foreground.push_back(colour);
+void make_palette(struct image& img, const struct config& cfg, rand_gen& rng) {
+	const size_t size = count_foreground(img);
+	if (size == 0 || (cfg.cluster == PNGSQ_CLUSTER_SAMPLE && cfg.sampled <= 0)) {
+		// Nothing to sample, so every entry is the background colour
+		std::fill(img.palette + 1, img.palette + 16, img.palette[0]);
+		return;
 	}
-	size = foreground.size();
-	const int n = (int)std::min(size, (size_t)cfg.sampled);
-	auto sample = std::make_unique<struct rgb*[]>(n);
-	res_sample(sample.get(), n, foreground.data(), size);
-	k_means_pp(img, sample.get(), n);
-	k_means(img, sample.get(), n, cfg);
-	for (size_t i = 0; i < size; i++) {
-		struct rgb& px = *foreground[i];
-		float best = FLT_MAX;
-		int colour = 0;
-		for (int entry = 0; entry < 16; entry++) {
-			float dist = dist2(px, img.palette[entry]);
-			if (best > dist) {
-				best = dist;
-				colour = entry;
-			}
-		}
-		px.r = img.palette[colour].r;
-		px.g = img.palette[colour].g;
-		px.b = img.palette[colour].b;
+	std::vector<struct rgb> points;
+	std::vector<uint32_t> weights;
+	if (cfg.cluster == PNGSQ_CLUSTER_HISTOGRAM)
+		colour_counts(img, points, weights);
+	else {
+		points.resize(std::min(size, (size_t)cfg.sampled));
+		res_sample(points.data(), (int)points.size(), img, rng);
 	}
+	uint32_t const* const w = weights.empty() ? nullptr : weights.data();
+	// Trials run side by side, each with its own generator split in order, and the one with the lowest inertia wins
+	// A single trial gets every thread instead
+	const int threads = thread_count(cfg.threads), trials = std::max(1, cfg.trials);
+	std::vector<rand_gen> rngs;
+	for (int trial = 0; trial < trials; trial++)
+		rngs.push_back(rng.split());
+	std::vector<std::array<struct rgb, 15>> palettes(trials);
+	std::vector<uint64_t> costs(trials);
+	parallel_for(trials, threads, [&](size_t first, size_t last, int) {
+		for (size_t trial = first; trial < last; trial++) {
+			struct rgb* const centroids = palettes[trial].data();
+			if (cfg.seeding == PNGSQ_SEED_PARALLEL)
+				k_means_par(centroids, 15, points.data(), w, points.size(), rngs[trial], trials > 1 ? 1 : threads);
+			else
+				k_means_pp(centroids, 15, points.data(), w, points.size(), rngs[trial]);
+			k_means(centroids, 15, points.data(), w, points.size(), cfg.iters, cfg.tolerance);
+			costs[trial] = k_means_cost(centroids, 15, points.data(), w, points.size());
+		}
+	});
+	const size_t best = std::min_element(costs.begin(), costs.end()) - costs.begin();
+	std::copy(palettes[best].begin(), palettes[best].end(), img.palette + 1);
+	map_foreground(img, threads);
 }
 
 void use_palette(struct image& img, const struct config& cfg) {
-	size_t size = (size_t)img.out_width * (size_t)img.out_height;
-	struct rgb* pxs = bytes_to_rgb(img.data_output, size);
-	std::vector<struct rgb*> foreground;
-	for (size_t i = 0; i < size; i++) {
-		struct rgb* colour = &pxs[i];
-		if (*colour != img.palette[0])
-			foreground.push_back(colour);
+	map_foreground(img, thread_count(cfg.threads));
+}
+
+bool squish_fused(struct image& img, const std::vector<struct threshold>& thrs, const struct config& cfg, rand_gen& rng) {
+	const int threads = thread_count(cfg.threads), step = std::max(1, cfg.fused);
+	const mat<3> m = quad_matrix(img);
+	// Every `step`-th output pixel across and down, with exactly the values the full output will have there
+	struct image probe = {0};
+	probe.data_orig = img.data_orig;
+	probe.width = img.width;
+	probe.height = img.height;
+	probe.out_width = (img.out_width + step - 1) / step;
+	probe.out_height = (img.out_height + step - 1) / step;
+	if (!alloc_output(probe)) {
+		probe.data_orig = nullptr;
+		free_image(probe);
+		return false;
 	}
-	size = foreground.size();
-	for (size_t i = 0; i < size; i++) {
-		struct rgb& px = *foreground[i];
-		float best = FLT_MAX;
-		int colour = 0;
-		for (int entry = 0; entry < 16; entry++) {
-			float dist = dist2(px, img.palette[entry]);
-			if (best > dist) {
-				best = dist;
-				colour = entry;
+	parallel_for(probe.out_height, threads, [&](size_t first, size_t last, int) {
+		for (size_t y = first; y < last; y++)
+			warp_row(img, m, (int)y * step, 0, img.out_width, step, probe.data_dewarp + (size_t)3 * probe.out_width * y);
+	});
+	const struct rgb background = find_background(probe, cfg, threads);
+	const struct rgb replacement = cfg.ovr_bg_after ? cfg.ovr_bg_after_col : background;
+	bg_table& table = background_table(thrs, background, cfg.dark);
+	classify(probe, table, replacement, threads);
+	probe.palette[0] = replacement;
+	make_palette(probe, cfg, rng);
+	std::copy(probe.palette, probe.palette + 16, img.palette);
+	probe.data_orig = nullptr; // owned by `img`
+	free_image(probe);
+	if (!alloc_output(img, false))
+		return false;
+
+	// Each tile is warped a row at a time into a buffer that stays in cache, then classified and mapped from there
+	thread_local palette_map cache;
+	const palette_map& map = cache;
+	cache.build(img.palette);
+	constexpr int tile = 64; // one mask word across
+	const size_t width = img.out_width, stride = mask_stride(img.out_width);
+	const size_t rows = ((size_t)img.out_height + tile - 1) / tile;
+	parallel_for(rows, threads, [&](size_t first, size_t last, int) {
+		unsigned char buf[3 * tile];
+		for (size_t row = first; row < last; row++) {
+			const int y_end = std::min((int)(row + 1) * tile, img.out_height);
+			for (int x = 0; x < img.out_width; x += tile) {
+				const size_t count = std::min((size_t)tile, width - x);
+				for (int y = (int)row * tile; y < y_end; y++) {
+					warp_row(img, m, y, x, x + (int)count, 1, buf);
+					struct rgb const* const pixels = bytes_to_rgb(buf, count);
+					table.resolve(pixels, count);
+					const uint64_t bits = background_bits(table, pixels, count, replacement);
+					img.data_mask[y * stride + x / tile] = bits;
+					unsigned char* const index = img.data_index + y * width + x;
+					std::memset(index, 0, count);
+					map_word(img, map, pixels, count, bits, index);
+				}
 			}
 		}
-		px.r = img.palette[colour].r;
-		px.g = img.palette[colour].g;
-		px.b = img.palette[colour].b;
-	}
+	});
+	return true;
 }
@@ -8,9 +8,9 @@
 #include "nativefiledialog-extended/src/include/nfd.h"
 
 #include "head.hpp"
+#include "batch.hpp"
 #include "gui.hpp" // Includes Dear ImGui/glad/GLFW headers
 #include "perspective.hpp"
-#include "random.hpp"
 
 static struct wndinfo window;
 
@@ -51,6 +51,14 @@ static void cleanup(void) {
 }
 
 int main(int argc, char** argv) {
+	// Debugging aid for the OpenGL dewarp: `pngsquish --check-warp [--tile <size>] <image>...` compares it with the CPU
+	// warp on each image, in tiles of at most `size` texels to exercise the splitting on images that would fit in one
+	const bool check = argc > 2 && std::strcmp(argv[1], "--check-warp") == 0;
+	if (argc > 1 && !check)
+		return run_batch(argc, argv);
+	const int check_tile = check && argc > 4 && std::strcmp(argv[2], "--tile") == 0 ? std::atoi(argv[3]) : 0;
+	const int check_first = check_tile > 0 ? 4 : 2;
+
 	glfwSetErrorCallback(glfw_err_cb);
 	if (!glfwInit())
 		return EXIT_FAILURE;
@@ -59,6 +67,8 @@ int main(int argc, char** argv) {
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_SCALE_TO_MONITOR, GL_TRUE);
 	glfwWindowHint(GLFW_SAMPLES, 4);
+	// Checking the warp only needs the context
+	glfwWindowHint(GLFW_VISIBLE, check ? GLFW_FALSE : GLFW_TRUE);
 	::window = {
 		.window = glfwCreateWindow(1024, 576, "pngsquish", nullptr, nullptr),
 		.nfd_init = NFD_Init() == NFD_OKAY
@@ -77,13 +87,18 @@ int main(int argc, char** argv) {
 		return EXIT_FAILURE;
 	}
 
-	init_rand();
 	if (!init_shaders_persp() || !init_shaders_prev()) {
 		std::fprintf(stderr, PNGSQ_ERROR_STRING "(This error message shouldn't ever appear)\n");
 		cleanup();
 		return EXIT_FAILURE;
 	}
 
+	if (check) {
+		const bool ok = check_transforms(argv + check_first, argc - check_first, check_tile);
+		cleanup();
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	IMGUI_CHECKVERSION();
 	ImGui::CreateContext();
 	ImGuiIO& io = ImGui::GetIO();
@@ -119,7 +134,7 @@ int main(int argc, char** argv) {
 		glfwSwapBuffers(::window.window);
 	}
 
-	free_image(img);
+	free_image_preview(img);
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
@@ -0,0 +1,65 @@
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include "palette.hpp"
+
+palette_map::palette_map(void) : candidates(std::make_unique<uint16_t[]>(cells)), palette(), built(false) {}
+
+// Squared distance along one channel from `value` to the nearest and furthest points of [low, high]
+static inline void channel_range(int value, int low, int high, int& near, int& far) {
+	const int d = value < low ? low - value : value > high ? value - high : 0;
+	const int f = std::max(std::abs(value - low), std::abs(value - high));
+	near = d * d;
+	far = f * f;
+}
+
+void palette_map::build(struct rgb const* palette) {
+	if (this->built && std::equal(palette, palette + 16, this->palette))
+		return;
+	std::copy(palette, palette + 16, this->palette);
+	this->built = true;
+	constexpr int size = 1 << bits, width = 1 << (8 - bits);
+	for (int r = 0; r < size; r++) {
+		for (int g = 0; g < size; g++) {
+			for (int b = 0; b < size; b++) {
+				const int low[3] = { r * width, g * width, b * width };
+				int near[16], far = INT_MAX;
+				for (int entry = 0; entry < 16; entry++) {
+					const unsigned char value[3] = { palette[entry].r, palette[entry].g, palette[entry].b };
+					int entry_near = 0, entry_far = 0;
+					for (int c = 0; c < 3; c++) {
+						int n, f;
+						channel_range(value[c], low[c], low[c] + width - 1, n, f);
+						entry_near += n;
+						entry_far += f;
+					}
+					near[entry] = entry_near;
+					far = std::min(far, entry_far);
+				}
+				// Every colour in the cell is within `far` of some entry, so entries that are never that close can be skipped
+				uint16_t set = 0;
+				for (int entry = 0; entry < 16; entry++)
+					if (near[entry] <= far)
+						set |= (uint16_t)(1u << entry);
+				this->candidates[cell({ (unsigned char)low[0], (unsigned char)low[1], (unsigned char)low[2] })] = set;
+			}
+		}
+	}
+}
+
+unsigned char palette_map::evaluate(const struct rgb& colour) const {
+	int best = INT_MAX;
+	unsigned char result = 0;
+	for (int entry = 0; entry < 16; entry++) {
+		const int dist = dist2(colour, this->palette[entry]);
+		if (best > dist) {
+			best = dist;
+			result = (unsigned char)entry;
+		}
+	}
+	return result;
+}
@@ -1,11 +1,17 @@
+#include <algorithm>
 #include <cfloat>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <deque>
+#include <vector>
 
 #include "glad/glad.h"
 
 #include "head.hpp"
+#include "gl.hpp"
 #include "matrix.hpp"
 #include "perspective.hpp"
 
@@ -15,20 +21,23 @@ namespace {
 in vec4 vertex;
 out vec2 coords;
 uniform mat3 transform;
+uniform vec4 region;
 
 void main() {
 	vec3 transformed = transform * vec3(vertex.xy, 1.0);
-	gl_Position = vec4(transformed.xy / transformed.z, 1.0, 1.0);
-	coords = vertex.zw;
+	// Dividing by `transformed.z` here would interpolate the coordinates linearly across each triangle
+	gl_Position = vec4(transformed.xy, 0.0, transformed.z);
+	coords = vertex.zw * region.xy + region.zw;
 }
 )""\0";
 	char const* shader_frag = PNGSQ_GLSL_VERSION_STRING R"(
 in vec2 coords;
 out vec4 outcol;
 uniform sampler2D sampler;
+uniform vec4 bounds;
 
 void main() {
-	outcol = texture(sampler, coords);
+	outcol = texture(sampler, clamp(coords, bounds.xy, bounds.zw));
 }
 )""\0";
 }
@@ -108,8 +117,67 @@ bool init_shaders_persp(void) {
 	return true;
 }
 
+// GL objects kept between transforms, so that dragging the corners of the quadrilateral does not reallocate anything
+// Textures only ever grow; the region of them in use is given to the shaders through uniforms
+namespace {
+	struct texture_store {
+		GLuint tex;
+		int width, height; // allocated size
+	};
+	struct texture_store source, target;
+	// Region of `source` that was last uploaded, to skip uploading it again if the next tile needs the same texels
+	struct {
+		unsigned char const* data;
+		int width, x0, y0, x1, y1;
+	} uploaded;
+	// Readback buffers, used in turn so that starting a transform does not wait for the previous one to be read
+	struct readback {
+		GLuint pbo;
+		GLsync fence;
+		size_t size;
+		int width, height;
+	} readbacks[2];
+	int pending = -1; // index into `readbacks` of the latest unfinished transform
+}
+
+// Makes `store` at least `width` x `height`, leaving it bound
+// Returns true if a new texture had to be created, losing the contents of the old one
+static bool reserve_texture(struct texture_store& store, int width, int height) {
+	if (store.tex != 0 && store.width >= width && store.height >= height) {
+		glBindTexture(GL_TEXTURE_2D, store.tex);
+		return false;
+	}
+	if (store.tex != 0)
+		glDeleteTextures(1, &store.tex);
+	store.width = std::max(store.width, width);
+	store.height = std::max(store.height, height);
+	store.tex = create_texture(nullptr, store.width, store.height, false);
+	return true;
+}
+
+static void free_texture(struct texture_store& store) {
+	if (store.tex != 0)
+		glDeleteTextures(1, &store.tex);
+	store = {0};
+}
+
+void forget_transform_source(void) {
+	::uploaded.data = nullptr;
+}
+
 void deinit_shaders_persp(void) {
 	if (::program != 0) {
+		for (struct readback& rb : ::readbacks) {
+			if (rb.fence != nullptr)
+				glDeleteSync(rb.fence);
+			if (rb.pbo != 0)
+				glDeleteBuffers(1, &rb.pbo);
+			rb = {0};
+		}
+		::pending = -1;
+		free_texture(::source);
+		free_texture(::target);
+		forget_transform_source();
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		glDeleteFramebuffers(1, &::fbo);
 		glUseProgram(0);
@@ -120,76 +188,279 @@ void deinit_shaders_persp(void) {
 	}
 }
 
-// Scales a point from normalized coordinates to image coordinates
-static constexpr struct point scale(const struct point& p, const struct image& img) {
-	return { p.x * img.width, p.y * img.height };
-}
-
-// Computes the perspective transformation matrix from quadrilateral `img.dewarp_src` to a 2x2 square centred at (0, 0)
-// Based on Heckbert (1989), page 20
+// Computes the perspective transformation matrix from the source image to the output, both in NDC with rows in memory
+// order going up, so that the output is quadrilateral `img.dewarp_src` stretched over the whole viewport
+// `quad_matrix` counts image coordinates up from the last row and the unit square down from the first one, so both flip
 mat<3> persp_matrix(const struct image& img) {
-	struct point p0 = scale(img.dewarp_src.p[0], img);
-	struct point p1 = scale(img.dewarp_src.p[1], img);
-	struct point p2 = scale(img.dewarp_src.p[2], img);
-	struct point p3 = scale(img.dewarp_src.p[3], img);
-	float dx1 = p1.x - p2.x;
-	float dx2 = p3.x - p2.x;
-	float sx  = p0.x - p1.x - dx2;
-	float dy1 = p1.y - p2.y;
-	float dy2 = p3.y - p2.y;
-	float sy  = p0.y - p1.y - dy2;
-	float d   = (dx1 * dy2 - dy1 * dx2);
-	float m31 = (sx * dy2 - sy * dx2) / d;
-	float m32 = (dx1 * sy - dy1 * sx) / d;
-	mat<3> m;
-	m(1, 1) = p1.x - p0.x + m31 * p1.x;
-	m(1, 2) = p3.x - p0.x + m32 * p3.x;
-	m(1, 3) = p0.x;
-	m(2, 1) = p1.y - p0.y + m31 * p1.y;
-	m(2, 2) = p3.y - p0.y + m32 * p3.y;
-	m(2, 3) = p0.y;
-	m(3, 1) = m31;
-	m(3, 2) = m32;
-	m(3, 3) = 1.0f;
-	return mat<3>( // transform to NDC
+	return mat<3>( // unit square to NDC
 		2.0f,  0.0f, -1.0f,
-		0.0f,  2.0f, -1.0f,
+		0.0f, -2.0f,  1.0f,
 		0.0f,  0.0f,  1.0f
-	) * ~m;
+	) * ~quad_matrix(img) * mat<3>( // NDC to image coordinates
+		0.5f * img.width, 0.0f, 0.5f * img.width,
+		0.0f, -0.5f * img.height, 0.5f * img.height,
+		0.0f, 0.0f, 1.0f
+	);
 }
 
-void transform_image(struct image& img, const mat<3>& transform, const struct config& cfg) {
-	std::free(img.data_dewarp);
-	std::free(img.data_output);
-	size_t size = (size_t)3 * img.out_width * img.out_height;
-	img.data_dewarp = (unsigned char*)std::malloc(size);
-	img.data_output = (unsigned char*)std::malloc(size);
-	if (img.data_dewarp == nullptr || img.data_output == nullptr)
+// Largest tile rendered at once, which bounds the GPU memory used whatever the size of the image
+static constexpr int max_tile = 4096;
+namespace {
+	int tile_limit = max_tile; // lowered by `check_transforms` to split images that would otherwise fit in one tile
+}
+
+// Renders output pixels [x, x + w) x [y, y + h), counted from the bottom left, and reads them back to `offset`
+// bytes into the bound pixel pack buffer, laid out like `img.data_dewarp`
+// Only the part of the source that the tile samples is uploaded; tiles that sample more than `limit` texels across are
+// split in half. `tex_full` is used instead if it holds the whole source.
+static void render_tile(const struct image& img, const mat<3>& transform, const mat<3>& inverse, int x, int y, int w, int h, int limit, GLuint tex_full) {
+	// Map the corners of the tile back to texels of the source
+	float lo_x = FLT_MAX, lo_y = FLT_MAX, hi_x = -FLT_MAX, hi_y = -FLT_MAX;
+	for (int corner = 0; corner < 4; corner++) {
+		const float nx = 2.0f * (x + (corner & 1) * w) / img.out_width - 1.0f;
+		const float ny = 2.0f * (y + (corner >> 1) * h) / img.out_height - 1.0f;
+		const float z = inverse(3, 1) * nx + inverse(3, 2) * ny + inverse(3, 3);
+		const float sx = ((inverse(1, 1) * nx + inverse(1, 2) * ny + inverse(1, 3)) / z + 1.0f) * 0.5f * img.width;
+		const float sy = ((inverse(2, 1) * nx + inverse(2, 2) * ny + inverse(2, 3)) / z + 1.0f) * 0.5f * img.height;
+		lo_x = std::min(lo_x, sx);
+		lo_y = std::min(lo_y, sy);
+		hi_x = std::max(hi_x, sx);
+		hi_y = std::max(hi_y, sy);
+	}
+	// One extra texel on each side for the bilinear filter
+	const int x0 = std::clamp((int)std::floor(lo_x) - 1, 0, img.width - 1), y0 = std::clamp((int)std::floor(lo_y) - 1, 0, img.height - 1);
+	int x1 = std::clamp((int)std::ceil(hi_x) + 1, x0 + 1, img.width), y1 = std::clamp((int)std::ceil(hi_y) + 1, y0 + 1, img.height);
+	if ((x1 - x0 > limit || y1 - y0 > limit) && (w > 1 || h > 1)) {
+		if (w >= h) {
+			render_tile(img, transform, inverse, x, y, w / 2, h, limit, tex_full);
+			render_tile(img, transform, inverse, x + w / 2, y, w - w / 2, h, limit, tex_full);
+		}
+		else {
+			render_tile(img, transform, inverse, x, y, w, h / 2, limit, tex_full);
+			render_tile(img, transform, inverse, x, y + h / 2, w, h - h / 2, limit, tex_full);
+		}
+		return;
+	}
+	x1 = std::min(x1, x0 + limit);
+	y1 = std::min(y1, y0 + limit);
+	int tex_w = img.width, tex_h = img.height;
+	if (tex_full != 0 && x0 == 0 && y0 == 0 && x1 == img.width && y1 == img.height)
+		glBindTexture(GL_TEXTURE_2D, tex_full);
+	else {
+		if (reserve_texture(::source, x1 - x0, y1 - y0))
+			forget_transform_source();
+		tex_w = ::source.width;
+		tex_h = ::source.height;
+		if (::uploaded.data != img.data_orig || ::uploaded.width != img.width
+			|| ::uploaded.x0 != x0 || ::uploaded.y0 != y0 || ::uploaded.x1 != x1 || ::uploaded.y1 != y1) {
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, img.width);
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS, x0);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS, y0);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, x1 - x0, y1 - y0, GL_RGB, GL_UNSIGNED_BYTE, img.data_orig);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+			::uploaded = { img.data_orig, img.width, x0, y0, x1, y1 };
+		}
+	}
+	// Stretch the tile over the whole viewport, and the texture coordinates over the uploaded region
+	const mat<3> tile = mat<3>(
+		(float)img.out_width / w, 0.0f, (float)(img.out_width - 2 * x) / w - 1.0f,
+		0.0f, (float)img.out_height / h, (float)(img.out_height - 2 * y) / h - 1.0f,
+		0.0f, 0.0f, 1.0f
+	) * transform;
+	glUniformMatrix3fv(glGetUniformLocation(::program, "transform"), 1, GL_TRUE, tile.ptr());
+	glUniform4f(glGetUniformLocation(::program, "region"),
+		(float)img.width / tex_w, (float)img.height / tex_h, (float)-x0 / tex_w, (float)-y0 / tex_h);
+	// Texel centres at the edges of the region, since the texture may extend past it
+	glUniform4f(glGetUniformLocation(::program, "bounds"),
+		0.5f / tex_w, 0.5f / tex_h, (x1 - x0 - 0.5f) / tex_w, (y1 - y0 - 0.5f) / tex_h);
+	glViewport(0, 0, w, h);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+	const size_t offset = (size_t)3 * ((size_t)img.out_width * y + x);
+	glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, (void*)offset);
+}
+
+void start_transform(struct image& img, const mat<3>& transform, const struct config& cfg) {
+	if (!alloc_output(img))
 		return;
+	GLint max_size = 0, max_viewport[2] = { 0, 0 };
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	glGetIntegerv(GL_MAX_VIEWPORT_DIMS, max_viewport);
+	const int limit = std::min({ (int)max_size, (int)max_viewport[0], (int)max_viewport[1], ::tile_limit });
+	const int tile_w = std::min(img.out_width, limit), tile_h = std::min(img.out_height, limit);
 	glBindFramebuffer(GL_FRAMEBUFFER, ::fbo);
-	glViewport(0, 0, img.out_width, img.out_height);
-	GLuint tex_dewarp = create_texture(nullptr, img.out_width, img.out_height, false);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex_dewarp, 0);
+	if (reserve_texture(::target, tile_w, tile_h))
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ::target.tex, 0);
+	// Use whichever buffer is not holding the latest transform; the other one is abandoned if still unread
+	struct readback& rb = ::readbacks[::pending == 0 ? 1 : 0];
+	if (rb.fence != nullptr) {
+		glDeleteSync(rb.fence);
+		rb.fence = nullptr;
+	}
+	if (rb.pbo == 0)
+		glGenBuffers(1, &rb.pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+	rb.size = (size_t)3 * img.out_width * img.out_height;
+	rb.width = img.out_width;
+	rb.height = img.out_height;
+	// Respecifying the storage lets the driver hand over fresh memory rather than wait for any earlier reads
+	glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)rb.size, nullptr, GL_STREAM_READ);
 	glUseProgram(::program);
-	glUniformMatrix3fv(glGetUniformLocation(::program, "transform"), 1, GL_TRUE, transform.ptr());
 	glActiveTexture(GL_TEXTURE0);
-	GLuint tex_original = cfg.prev_stage == PNGSQ_PREVIEW_ORIGINAL ? img.texture : create_texture(img.data_orig, img.width, img.height, false);
-	glClear(GL_COLOR_BUFFER_BIT);
+	// The preview texture already holds the whole source, if it is small enough to have been uploaded in one piece
+	const bool reuse = cfg.prev_stage == PNGSQ_PREVIEW_ORIGINAL && img.width <= limit && img.height <= limit;
+	GLuint tex_original = reuse ? img.texture : 0;
 	glBindVertexArray(::vao);
-	glDrawArrays(GL_TRIANGLES, 0, 6);
 	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_PACK_ROW_LENGTH, img.out_width);
+	const mat<3> inverse = ~transform;
+	for (int y = 0; y < img.out_height; y += tile_h)
+		for (int x = 0; x < img.out_width; x += tile_w)
+			render_tile(img, transform, inverse, x, y, std::min(tile_w, img.out_width - x), std::min(tile_h, img.out_height - y), limit, tex_original);
 	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
-	glReadPixels(0, 0, img.out_width, img.out_height, GL_RGB, GL_UNSIGNED_BYTE, img.data_dewarp);
-	std::memcpy(img.data_output, img.data_dewarp, size);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	// Fences need OpenGL 3.2; without them `finish_transform` simply waits when mapping the buffer
+	if (glFenceSync != nullptr)
+		rb.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	::pending = (int)(&rb - ::readbacks);
+	// The framebuffer texture holds the whole output if it fit in a single tile, so copy it over for the preview
+	if (cfg.prev_stage == PNGSQ_PREVIEW_DEWARPED && tile_w == img.out_width && tile_h == img.out_height && img.texture != 0) {
+		glBindTexture(GL_TEXTURE_2D, img.texture);
+		glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 0, 0, img.out_width, img.out_height, 0);
+	}
 	glBindVertexArray(0);
 	glBindTexture(GL_TEXTURE_2D, 0);
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	if (cfg.prev_stage != PNGSQ_PREVIEW_ORIGINAL)
-		glDeleteTextures(1, &tex_original);
-	if (cfg.prev_stage != PNGSQ_PREVIEW_DEWARPED)
-		glDeleteTextures(1, &tex_dewarp);
-	else if (img.texture != 0) {
-		glDeleteTextures(1, &img.texture);
-		img.texture = tex_dewarp;
+}
+
+bool finish_transform(struct image& img, bool wait) {
+	if (::pending < 0)
+		return false;
+	struct readback& rb = ::readbacks[::pending];
+	if (rb.fence != nullptr) {
+		GLenum status;
+		do
+			status = glClientWaitSync(rb.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000 : 0);
+		while (wait && status == GL_TIMEOUT_EXPIRED);
+		if (status == GL_TIMEOUT_EXPIRED)
+			return false;
+		glDeleteSync(rb.fence);
+		rb.fence = nullptr;
+	}
+	::pending = -1;
+	// The output was resized since the transform started, so the result no longer fits
+	if (rb.width != img.out_width || rb.height != img.out_height || img.data_dewarp == nullptr)
+		return false;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+	void const* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)rb.size, GL_MAP_READ_BIT);
+	const bool mapped = data != nullptr;
+	if (mapped) {
+		std::memcpy(img.data_dewarp, data, rb.size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	return mapped;
+}
+
+void transform_image(struct image& img, const mat<3>& transform, const struct config& cfg) {
+	start_transform(img, transform, cfg);
+	finish_transform(img, true);
+}
+
+int compare_transforms(struct image& img, const struct config& cfg, bool overlap) {
+	if (!warp_image(img, quad_matrix(img), cfg.threads))
+		return -1;
+	const size_t size = (size_t)3 * img.out_width * img.out_height;
+	std::vector<unsigned char> cpu(img.data_dewarp, img.data_dewarp + size);
+	int polls = 0;
+	if (overlap) {
+		// Abandon a transform of the image turned upside down, so the result comes through the other readback buffer
+		start_transform(img, mat<3>(-1.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f) * persp_matrix(img), cfg);
+		start_transform(img, persp_matrix(img), cfg);
+		// Only a failed allocation keeps the result from ever arriving, since the size stays the same
+		for (; !finish_transform(img, false); polls++) {
+			if (img.data_dewarp == nullptr)
+				return -1;
+		}
+	}
+	else {
+		start_transform(img, persp_matrix(img), cfg);
+		if (!finish_transform(img, true))
+			return -1;
+	}
+	int largest = 0;
+	uint64_t total = 0;
+	size_t over = 0;
+	for (size_t i = 0; i < size; i++) {
+		const int diff = std::abs((int)img.data_dewarp[i] - (int)cpu[i]);
+		largest = std::max(largest, diff);
+		total += diff;
+		over += diff > 1;
+	}
+	char overlapped[48] = "";
+	if (overlap)
+		std::snprintf(overlapped, sizeof(overlapped), " (overlapped, done on poll %d)", polls + 1);
+	std::printf("%d x %d%s: OpenGL and CPU differ by at most %d, %.4f on average, and by more than 1 in %zu of %zu channels\n",
+		img.out_width, img.out_height, overlapped, largest, (double)total / size, over, size);
+	return largest;
+}
+
+bool check_transforms(char const* const* paths, int count, int tile) {
+	// The whole image, a skewed quadrilateral and two drags of its corners, the second with a larger output than the
+	// source, then the whole image again at half size, so that tiles sample twice their size and are split
+	static constexpr struct quad quads[] = {
+		{{ { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 1.0f, 1.0f }, { 0.0f, 1.0f } }},
+		{{ { 0.08f, 0.05f }, { 0.95f, 0.12f }, { 0.88f, 0.97f }, { 0.02f, 0.9f } }},
+		{{ { 0.1f, 0.05f }, { 0.95f, 0.12f }, { 0.88f, 0.97f }, { 0.02f, 0.9f } }},
+		{{ { 0.1f, 0.05f }, { 0.9f, 0.2f }, { 0.85f, 0.95f }, { 0.02f, 0.9f } }},
+		{{ { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 1.0f, 1.0f }, { 0.0f, 1.0f } }}
+	};
+	static constexpr float scales[] = { 1.0f, 1.0f, 1.0f, 1.25f, 0.5f };
+	GLint max_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	::tile_limit = tile > 0 ? tile : max_tile;
+	std::printf("Tiles of at most %d texels, OpenGL limit %d\n", std::min((int)max_size, ::tile_limit), (int)max_size);
+	struct config cfg = {};
+	bool ok = true;
+	// Each image goes into the pixels of the one before if it is the same size, as the allocator is free to do, and
+	// starts on the same region of the source as that one ended on: only `forget_transform_source` then keeps the
+	// upload from being skipped
+	unsigned char* last = nullptr;
+	size_t last_size = 0;
+	for (int i = 0; i < count; i++) {
+		struct image img = {0};
+		if (!load_image(img, paths[i])) {
+			std::fprintf(stderr, PNGSQ_ERROR_STRING "Failed to load %s\n", paths[i]);
+			ok = false;
+			continue;
+		}
+		const size_t size = (size_t)3 * img.width * img.height;
+		if (last != nullptr && last_size == size) {
+			std::memcpy(last, img.data_orig, size);
+			std::swap(last, img.data_orig);
+		}
+		std::free(last);
+		std::printf("%s\n", paths[i]);
+		for (size_t q = 0; q < std::size(quads); q++) {
+			img.dewarp_src = quads[q];
+			img.out_width = (int)(img.width * scales[q]);
+			img.out_height = (int)(img.height * scales[q]);
+			// Bilinear filtering on the GPU rounds the texel weights, which moves channels by up to 2 from `warp_image`
+			for (bool overlap: { false, true }) {
+				const int largest = compare_transforms(img, cfg, overlap);
+				ok &= largest >= 0 && largest <= 2;
+			}
+		}
+		forget_transform_source();
+		last = img.data_orig;
+		last_size = size;
+		img.data_orig = nullptr;
+		free_image(img);
 	}
+	std::free(last);
+	::tile_limit = max_tile;
+	return ok;
 }
@@ -2,13 +2,19 @@
 #include <cfloat>
 #include <cmath>
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <memory>
 #include <string>
 
 #include "glad/glad.h"
 
 #include "head.hpp"
 #include "gui.hpp"
+#include "perspective.hpp"
+
+#include "stb_image_resize2.h"
 
 namespace {
 	GLuint vao, vbo, program, fbo, texture;
@@ -30,6 +36,51 @@ void main() {
 )""\0";
 }
 
+bool load_image_preview(struct image& img, char const* path, const struct config& cfg) {
+	struct image temp = {0};
+	if (!load_image(temp, path))
+		return false;
+	temp.path = (char*)std::malloc(std::strlen(path) + 1);
+	if (temp.path == nullptr) {
+		free_image_preview(temp);
+		return false;
+	}
+	std::strcpy(temp.path, path);
+	temp.dewarp_src = img.dewarp_src;
+	float scale = calc_prev_scale(temp.full_width, temp.full_height, cfg.prev_kbytes);
+	if (scale >= 1.0f) {
+		img = temp;
+		img.width = img.full_width;
+		img.height = img.full_height;
+		return true;
+	}
+	temp.width = scale * temp.full_width;
+	temp.height = scale * temp.full_height;
+	unsigned char* data = stbir_resize_uint8_srgb(
+		temp.data_orig, temp.full_width, temp.full_height, 0,
+		nullptr, temp.width, temp.height, 0,
+		STBIR_RGB);
+	std::free(temp.data_orig);
+	if (data == nullptr)
+		return false;
+	free_image_preview(img);
+	img = temp;
+	img.data_orig = data;
+	if (cfg.prev_stage == PNGSQ_PREVIEW_ORIGINAL)
+		img.texture = create_texture(data, img.width, img.height, false);
+	return true;
+}
+
+void free_image_preview(struct image& img) {
+	if (img.texture != 0) {
+		glDeleteTextures(1, &img.texture);
+		img.texture = 0;
+	}
+	forget_transform_source();
+	free_image(img);
+}
+
+static GLuint create_index_texture(const struct image& img);
 static constexpr float dist2(const struct point& left, const struct point& right);
 static bool fix_quad(struct quad* out, const std::deque<struct point>& in);
 static void draw_vertex(struct point vert, ImVec2 prev_pos, int id);
@@ -60,7 +111,7 @@ void window_preview(struct image& img, struct wndinfo& wnd, struct config& cfg)
 		if (ImGui::RadioButton("Processed", &cfg.prev_stage, PNGSQ_PREVIEW_PROCESSED) && stage != cfg.prev_stage) {
 			if (img.texture != 0)
 				glDeleteTextures(1, &img.texture);
-			img.texture = create_texture(img.data_output, img.out_width, img.out_height, false);
+			img.texture = create_index_texture(img);
 		}
 
 		if (img.texture != 0) {
@@ -378,6 +429,18 @@ static void draw_edge(struct point v1, struct point v2, ImVec2 prev_size, int id
 	glUniformMatrix3fv(glGetUniformLocation(::program, name.c_str()), 1, GL_TRUE, transform);
 }
 
+// Expands the index plane through the palette for display
+static GLuint create_index_texture(const struct image& img) {
+	if (img.data_index == nullptr)
+		return create_texture(nullptr, img.out_width, img.out_height, false);
+	const size_t count = (size_t)img.out_width * img.out_height;
+	auto pixels = std::make_unique<unsigned char[]>(3 * count);
+	struct rgb* const pxs = bytes_to_rgb(pixels.get(), count);
+	for (size_t i = 0; i < count; i++)
+		pxs[i] = img.palette[img.data_index[i] & 15];
+	return create_texture(pixels.get(), img.out_width, img.out_height, false);
+}
+
 bool init_shaders_prev(void) {
 	static constexpr GLfloat rect[] = {
 		-1.0f,  1.0f,
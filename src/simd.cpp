@@ -0,0 +1,46 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "simd.hpp"
+
+#if defined(PNGSQ_X86) && defined(_MSC_VER)
+#	include <intrin.h>
+#endif // defined(PNGSQ_X86) && defined(_MSC_VER)
+
+static int detect(void) {
+#if defined(PNGSQ_X86) && defined(_MSC_VER)
+	int info[4] = { 0 };
+	__cpuid(info, 0);
+	const int max = info[0];
+	__cpuid(info, 1);
+	const bool sse41 = info[2] & (1 << 19);
+	// AVX registers must also be enabled by the operating system
+	const bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+	bool avx2 = false;
+	if (max >= 7) {
+		__cpuidex(info, 7, 0);
+		avx2 = avx && (info[1] & (1 << 5));
+	}
+	return avx2 ? PNGSQ_SIMD_AVX2 : sse41 ? PNGSQ_SIMD_SSE41 : PNGSQ_SIMD_NONE;
+#elif defined(PNGSQ_X86)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? PNGSQ_SIMD_AVX2 : __builtin_cpu_supports("sse4.1") ? PNGSQ_SIMD_SSE41 : PNGSQ_SIMD_NONE;
+#else
+	return PNGSQ_SIMD_NONE;
+#endif
+}
+
+int simd_level(void) {
+	static const int level = []() {
+		int level = detect();
+		char const* env = std::getenv("PNGSQUISH_SIMD");
+		if (env == nullptr)
+			return level;
+		if (std::strcmp(env, "none") == 0)
+			return PNGSQ_SIMD_NONE;
+		if (std::strcmp(env, "sse4.1") == 0 && level > PNGSQ_SIMD_SSE41)
+			return PNGSQ_SIMD_SSE41;
+		return level;
+	}();
+	return level;
+}
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "head.hpp"
+#include "matrix.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+#include "warp.hpp"
+
+// Scales a point from normalized coordinates to image coordinates
+static constexpr struct point scale(const struct point& p, const struct image& img) {
+	return { p.x * img.width, p.y * img.height };
+}
+
+// Computes the perspective transformation matrix from the unit square to quadrilateral `img.dewarp_src`
+// Based on Heckbert (1989), page 20
+mat<3> quad_matrix(const struct image& img) {
+	struct point p0 = scale(img.dewarp_src.p[0], img);
+	struct point p1 = scale(img.dewarp_src.p[1], img);
+	struct point p2 = scale(img.dewarp_src.p[2], img);
+	struct point p3 = scale(img.dewarp_src.p[3], img);
+	float dx1 = p1.x - p2.x;
+	float dx2 = p3.x - p2.x;
+	float sx  = p0.x - p1.x - dx2;
+	float dy1 = p1.y - p2.y;
+	float dy2 = p3.y - p2.y;
+	float sy  = p0.y - p1.y - dy2;
+	float d   = (dx1 * dy2 - dy1 * dx2);
+	float m31 = (sx * dy2 - sy * dx2) / d;
+	float m32 = (dx1 * sy - dy1 * sx) / d;
+	mat<3> m;
+	m(1, 1) = p1.x - p0.x + m31 * p1.x;
+	m(1, 2) = p3.x - p0.x + m32 * p3.x;
+	m(1, 3) = p0.x;
+	m(2, 1) = p1.y - p0.y + m31 * p1.y;
+	m(2, 2) = p3.y - p0.y + m32 * p3.y;
+	m(2, 3) = p0.y;
+	m(3, 1) = m31;
+	m(3, 2) = m32;
+	m(3, 3) = 1.0f;
+	return m;
+}
+
+// Bilinearly samples `img.data_orig` at (x, y) in pixel coordinates, clamping to the edges like `GL_CLAMP_TO_EDGE`
+static inline void sample(const struct image& img, float x, float y, unsigned char* out) {
+	const float fx = std::floor(x), fy = std::floor(y);
+	const float ax = x - fx, ay = y - fy;
+	const int x0 = std::clamp((int)fx, 0, img.width - 1), x1 = std::clamp((int)fx + 1, 0, img.width - 1);
+	const int y0 = std::clamp((int)fy, 0, img.height - 1), y1 = std::clamp((int)fy + 1, 0, img.height - 1);
+	const size_t stride = (size_t)3 * img.width;
+	unsigned char const* const p00 = img.data_orig + y0 * stride + (size_t)3 * x0;
+	unsigned char const* const p01 = img.data_orig + y0 * stride + (size_t)3 * x1;
+	unsigned char const* const p10 = img.data_orig + y1 * stride + (size_t)3 * x0;
+	unsigned char const* const p11 = img.data_orig + y1 * stride + (size_t)3 * x1;
+	for (int c = 0; c < 3; c++) {
+		const float top = p00[c] + ax * (p01[c] - p00[c]);
+		const float bottom = p10[c] + ax * (p11[c] - p10[c]);
+		out[c] = (unsigned char)(top + ay * (bottom - top) + 0.5f);
+	}
+}
+
+// Transforms every `step`-th column in [first, last) of output row `y`, packed together into `out`
+static void warp_span(const struct image& img, const mat<3>& m, int y, int first, int last, int step, unsigned char* out) {
+	// Output rows are stored top to bottom, but `m` maps the bottom edge of the unit square to v = 0
+	const float v = 1.0f - (y + 0.5f) / img.out_height;
+	for (int x = first; x < last; x += step, out += 3) {
+		const float u = (x + 0.5f) / img.out_width;
+		const float w = m(3, 1) * u + m(3, 2) * v + m(3, 3);
+		const float sx = (m(1, 1) * u + m(1, 2) * v + m(1, 3)) / w;
+		const float sy = (m(2, 1) * u + m(2, 2) * v + m(2, 3)) / w;
+		sample(img, sx - 0.5f, img.height - sy - 0.5f, out);
+	}
+}
+
+#ifdef PNGSQ_X86
+// Same operations as `warp_span` and `sample` in the same order for 8 pixels at a time, so the results are identical
+// Each tap is gathered as 4 bytes, so the source must be smaller than 2 GiB
+PNGSQ_TARGET("avx2")
+static void warp_span_avx2(const struct image& img, const mat<3>& m, int y, int first, int last, int step, unsigned char* out) {
+	const float v = 1.0f - (y + 0.5f) / img.out_height;
+	const __m256 width = _mm256_set1_ps((float)img.out_width), half = _mm256_set1_ps(0.5f);
+	const __m256 w_v = _mm256_set1_ps(m(3, 2) * v), x_v = _mm256_set1_ps(m(1, 2) * v), y_v = _mm256_set1_ps(m(2, 2) * v);
+	const __m256 height = _mm256_set1_ps((float)img.height);
+	const __m256i max_x = _mm256_set1_epi32(img.width - 1), max_y = _mm256_set1_epi32(img.height - 1);
+	const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), bytes = _mm256_set1_epi32(0xff);
+	// The last pixel is gathered from one byte earlier so that the load stays inside the image
+	const __m256i final = _mm256_set1_epi32(img.width * img.height - 1);
+	int const* const base = reinterpret_cast<int const*>(img.data_orig);
+	const __m256i lanes = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(step));
+	int x = first;
+	for (; x + 7 * step < last; x += 8 * step, out += 24) {
+		const __m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), lanes)), half), width);
+		const __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m(3, 1)), u), w_v), _mm256_set1_ps(m(3, 3)));
+		const __m256 sx = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m(1, 1)), u), x_v), _mm256_set1_ps(m(1, 3))), w);
+		const __m256 sy = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m(2, 1)), u), y_v), _mm256_set1_ps(m(2, 3))), w);
+		const __m256 px = _mm256_sub_ps(sx, half), py = _mm256_sub_ps(_mm256_sub_ps(height, sy), half);
+		const __m256 fx = _mm256_floor_ps(px), fy = _mm256_floor_ps(py);
+		const __m256 ax = _mm256_sub_ps(px, fx), ay = _mm256_sub_ps(py, fy);
+		const __m256i ix = _mm256_cvttps_epi32(fx), iy = _mm256_cvttps_epi32(fy);
+		const __m256i x0 = _mm256_min_epi32(_mm256_max_epi32(ix, zero), max_x);
+		const __m256i x1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(ix, one), zero), max_x);
+		const __m256i y0 = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(iy, zero), max_y), _mm256_set1_epi32(img.width));
+		const __m256i y1 = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(iy, one), zero), max_y), _mm256_set1_epi32(img.width));
+		const __m256i taps[4] = {
+			_mm256_add_epi32(y0, x0), _mm256_add_epi32(y0, x1), _mm256_add_epi32(y1, x0), _mm256_add_epi32(y1, x1)
+		};
+		__m256i texels[4];
+		for (int t = 0; t < 4; t++) {
+			const __m256i last_px = _mm256_cmpeq_epi32(taps[t], final); // -1 where the tap is the last pixel
+			const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(taps[t], _mm256_set1_epi32(3)), last_px);
+			texels[t] = _mm256_srlv_epi32(_mm256_i32gather_epi32(base, offset, 1), _mm256_and_si256(last_px, _mm256_set1_epi32(8)));
+		}
+		__m256i result = zero;
+		for (int c = 0; c < 3; c++) {
+			const __m256i p00 = _mm256_and_si256(_mm256_srli_epi32(texels[0], 8 * c), bytes);
+			const __m256i p01 = _mm256_and_si256(_mm256_srli_epi32(texels[1], 8 * c), bytes);
+			const __m256i p10 = _mm256_and_si256(_mm256_srli_epi32(texels[2], 8 * c), bytes);
+			const __m256i p11 = _mm256_and_si256(_mm256_srli_epi32(texels[3], 8 * c), bytes);
+			const __m256 top = _mm256_add_ps(_mm256_cvtepi32_ps(p00), _mm256_mul_ps(ax, _mm256_cvtepi32_ps(_mm256_sub_epi32(p01, p00))));
+			const __m256 bottom = _mm256_add_ps(_mm256_cvtepi32_ps(p10), _mm256_mul_ps(ax, _mm256_cvtepi32_ps(_mm256_sub_epi32(p11, p10))));
+			const __m256 value = _mm256_add_ps(_mm256_add_ps(top, _mm256_mul_ps(ay, _mm256_sub_ps(bottom, top))), half);
+			result = _mm256_or_si256(result, _mm256_slli_epi32(_mm256_cvttps_epi32(value), 8 * c));
+		}
+		// Drop the fourth byte of each pixel, leaving 12 bytes in each half
+		const __m256i packed = _mm256_shuffle_epi8(result, _mm256_setr_epi8(
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+		alignas(32) unsigned char buf[32];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(buf), packed);
+		std::memcpy(out, buf, 12);
+		std::memcpy(out + 12, buf + 16, 12);
+	}
+	warp_span(img, m, y, x, last, step, out);
+}
+#endif // PNGSQ_X86
+
+// Picks the fastest span function that can handle the source of `img`
+static auto span_function(const struct image& img) {
+	void (*span)(const struct image&, const mat<3>&, int, int, int, int, unsigned char*) = warp_span;
+#ifdef PNGSQ_X86
+	if (simd_level() >= PNGSQ_SIMD_AVX2 && (size_t)3 * img.width * img.height <= INT32_MAX)
+		span = warp_span_avx2;
+#endif // PNGSQ_X86
+	return span;
+}
+
+void warp_row(const struct image& img, const mat<3>& m, int y, int first, int last, int step, unsigned char* out) {
+	span_function(img)(img, m, y, first, last, step, out);
+}
+
+bool warp_image(struct image& img, const mat<3>& m, int threads) {
+	if (!alloc_output(img))
+		return false;
+	// Tiles keep the source rows read by neighbouring output rows in cache when the page is rotated
+	constexpr int tile = 64;
+	const auto span = span_function(img);
+	const size_t rows = ((size_t)img.out_height + tile - 1) / tile;
+	parallel_for(rows, thread_count(threads), [&](size_t first, size_t last, int) {
+		for (size_t row = first; row < last; row++) {
+			const int y_end = std::min((int)(row + 1) * tile, img.out_height);
+			for (int x = 0; x < img.out_width; x += tile)
+				for (int y = (int)row * tile; y < y_end; y++)
+					span(img, m, y, x, std::min(x + tile, img.out_width), 1, img.data_dewarp + (size_t)3 * ((size_t)img.out_width * y + x));
+		}
+	});
+	return true;
+}
@@ -0,0 +1,130 @@
+// Times the background/threshold path at the SIMD level picked by PNGSQUISH_SIMD (none, sse4.1 or avx2) and checks
+// that it gives exactly the same results as the scalar code
+// CTest runs it once per level; the mask hash it prints is the same at every level
+// Usage: background_bench [width height]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "head.hpp"
+#include "classify.hpp"
+#include "random.hpp"
+#include "simd.hpp"
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Tests every 24-bit colour with `evaluate8` and with the scalar `evaluate`, and returns the number that disagree
+static size_t check_all_colours(const bg_table& table, double& simd_time, double& scalar_time) {
+	std::vector<uint32_t> results(bg_table::colours / 8);
+	auto start = std::chrono::steady_clock::now();
+	for (size_t block = 0; block < results.size(); block++) {
+		struct rgb colours[8];
+		for (size_t i = 0; i < 8; i++) {
+			const size_t key = block * 8 + i;
+			colours[i] = { (unsigned char)(key >> 16), (unsigned char)(key >> 8), (unsigned char)key };
+		}
+		results[block] = table.evaluate8(colours);
+	}
+	simd_time = seconds_since(start);
+	size_t mismatches = 0;
+	start = std::chrono::steady_clock::now();
+	for (size_t key = 0; key < bg_table::colours; key++) {
+		const bool background = table.evaluate({ (unsigned char)(key >> 16), (unsigned char)(key >> 8), (unsigned char)key });
+		mismatches += background != (bool)((results[key / 8] >> (key % 8)) & 1);
+	}
+	scalar_time = seconds_since(start);
+	return mismatches;
+}
+
+// Fills the dewarped image with paper, speckles of noise and strokes of dark and coloured ink
+static void make_page(struct image& img, rand_gen& rng) {
+	const size_t count = (size_t)img.out_width * img.out_height;
+	for (size_t i = 0; i < count; i++) {
+		unsigned char* const px = img.data_dewarp + 3 * i;
+		const int noise = (int)rng.next32(9) - 4;
+		px[0] = (unsigned char)(236 + noise);
+		px[1] = (unsigned char)(231 + noise);
+		px[2] = (unsigned char)(219 + noise);
+	}
+	for (int stroke = 0; stroke < img.out_height / 4; stroke++) {
+		const size_t y = rng.next32(img.out_height), x = rng.next32(img.out_width);
+		const size_t length = std::min((size_t)img.out_width - x, (size_t)rng.next32(200) + 1);
+		const bool coloured = rng.next32(4) == 0;
+		for (size_t i = 0; i < length; i++) {
+			unsigned char* const px = img.data_dewarp + 3 * (y * img.out_width + x + i);
+			const int shade = (int)rng.next32(64);
+			px[0] = (unsigned char)(coloured ? 180 + shade : 20 + shade);
+			px[1] = (unsigned char)(20 + shade);
+			px[2] = (unsigned char)(coloured ? 40 + shade : 30 + shade);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	struct image img = {0};
+	img.out_width = argc > 2 ? std::atoi(argv[1]) : 2400;
+	img.out_height = argc > 2 ? std::atoi(argv[2]) : 3200;
+	if (img.out_width <= 0 || img.out_height <= 0) {
+		std::fprintf(stderr, "usage: %s [width height]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	static char const* const levels[] = { "none", "sse4.1", "avx2" };
+	std::printf("SIMD level: %s\n", levels[simd_level()]);
+
+	// The default range threshold and a compare threshold, as set up by a job file
+	const std::vector<struct threshold> thrs = {
+		{ .selected = false, .diff = { 180.0f, 0.2f, 0.25f }, .mode = PNGSQ_VAL_MODE_RANGE, .enabled = true },
+		{ .selected = false, .diff = { 20.0f, 0.5f, 0.1f }, .mode = PNGSQ_VAL_MODE_COMPARE, .enabled = true }
+	};
+	bool ok = true;
+	bg_table table;
+	for (bool dark: { false, true }) {
+		table.compile(thrs, { 236, 231, 219 }, dark);
+		double simd_time, scalar_time;
+		const size_t mismatches = check_all_colours(table, simd_time, scalar_time);
+		std::printf("%-6s all colours%s: evaluate8 %.3f s, evaluate %.3f s, %zu differ\n",
+			mismatches == 0 ? "ok" : "FAIL", dark ? " (dark)" : "", simd_time, scalar_time, mismatches);
+		ok &= mismatches == 0;
+	}
+
+	if (!alloc_output(img))
+		return EXIT_FAILURE;
+	rand_gen rng(0x5eed);
+	make_page(img, rng);
+	struct config cfg = {};
+	cfg.threads = 1;
+	// The first pass fills this thread's table; the second finds every colour in it already
+	double pass_time[2];
+	for (double& time: pass_time) {
+		const auto start = std::chrono::steady_clock::now();
+		make_background(img, thrs, cfg);
+		time = seconds_since(start);
+	}
+	// Checks the mask against the scalar test, and hashes it with FNV-1a
+	table.compile(thrs, img.palette[0], cfg.dark);
+	const size_t stride = mask_stride(img.out_width);
+	struct rgb const* const pixels = bytes_to_rgb(img.data_dewarp, (size_t)img.out_width * img.out_height);
+	size_t mismatches = 0;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t y = 0; y < (size_t)img.out_height; y++) {
+		for (size_t x = 0; x < (size_t)img.out_width; x++) {
+			const struct rgb& px = pixels[y * img.out_width + x];
+			const bool expected = table.evaluate(px) || px == img.palette[0];
+			mismatches += expected != (bool)((img.data_mask[y * stride + x / 64] >> (x % 64)) & 1);
+		}
+		for (size_t word = 0; word < stride; word++)
+			hash = (hash ^ img.data_mask[y * stride + word]) * 0x100000001b3ULL;
+	}
+	std::printf("%-6s make_background %dx%d: %.3f s, then %.3f s with the table filled, %zu pixels differ, mask hash %016llx\n",
+		mismatches == 0 ? "ok" : "FAIL", img.out_width, img.out_height, pass_time[0], pass_time[1], mismatches,
+		(unsigned long long)hash);
+	ok &= mismatches == 0;
+	free_image(img);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,65 @@
+// Times the random variates and reservoir sampling at the sizes make_palette uses on a full page
+// Usage: sample_bench [sampled pixels, default 400000]
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "head.hpp"
+#include "random.hpp"
+
+// Runs `func` `count` times and prints the time per call
+template<typename F>
+static void time(char const* name, int count, F&& func) {
+	const auto start = std::chrono::steady_clock::now();
+	double sink = 0.0;
+	for (int i = 0; i < count; i++)
+		sink += func();
+	const double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	// Printing the sum keeps the calls from being optimized away
+	const double per = ns / count;
+	if (per >= 1e6)
+		std::printf("%-28s %10.2f ms per call  (%g)\n", name, per / 1e6, sink);
+	else
+		std::printf("%-28s %10.1f ns per call  (%g)\n", name, per, sink);
+}
+
+int main(int argc, char** argv) {
+	const int sampled = argc > 1 ? std::atoi(argv[1]) : 400000;
+	if (sampled <= 0) {
+		std::fprintf(stderr, "usage: %s [sampled pixels]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	rand_gen rng(0x5eed);
+	time("gamma_variate(0.5)", 1000000, [&]() { return rng.gamma_variate(0.5); });
+	time("gamma_variate(2.5)", 1000000, [&]() { return rng.gamma_variate(2.5); });
+	time("beta_variate(n, r + 1)", 1000000, [&]() { return rng.beta_variate(sampled, 2.07 * std::sqrt(sampled) + 1.0); });
+
+	// A 4800x6400 page (600 dpi letter) with half of it background in alternating runs of 64 pixels
+	constexpr int width = 4800, height = 6400;
+	struct image img = {0};
+	img.out_width = width;
+	img.out_height = height;
+	const size_t stride = mask_stride(width);
+	auto pixels = std::make_unique<unsigned char[]>((size_t)3 * width * height);
+	auto mask = std::make_unique<uint64_t[]>(stride * height);
+	for (size_t i = 0; i < (size_t)3 * width * height; i++)
+		pixels[i] = (unsigned char)rng.next32();
+	for (size_t y = 0; y < (size_t)height; y++)
+		for (size_t word = 0; word < stride; word++)
+			mask[y * stride + word] = (word + y) % 2 ? ~(uint64_t)0 : 0;
+	img.data_dewarp = pixels.get();
+	img.data_mask = mask.get();
+	std::vector<struct rgb> sample(sampled);
+	char name[64];
+	std::snprintf(name, sizeof(name), "res_sample(%d)", sampled);
+	time(name, 20, [&]() {
+		res_sample(sample.data(), sampled, img, rng);
+		return (double)sample[0].r;
+	});
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,130 @@
+// Statistical checks of the random variates and of reservoir sampling
+// Every check uses a fixed seed and a bound of several standard errors, so a failure means a real bias, not bad luck
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "head.hpp"
+#include "random.hpp"
+
+// Standard errors a moment may be off by before it counts as a failure
+static constexpr double bound = 5.0;
+
+// Compares the mean and variance of `samples` with the expected ones, scaling by the standard errors estimated from
+// the samples themselves
+static bool check_moments(char const* name, const std::vector<double>& samples, double mean, double variance) {
+	const double n = (double)samples.size();
+	double sum = 0.0;
+	for (double x: samples)
+		sum += x;
+	const double m = sum / n;
+	double m2 = 0.0, m4 = 0.0;
+	for (double x: samples) {
+		const double d = (x - m) * (x - m);
+		m2 += d;
+		m4 += d * d;
+	}
+	m2 /= n;
+	m4 /= n;
+	const double z_mean = (m - mean) / std::sqrt(m2 / n);
+	const double z_var = (m2 - variance) / std::sqrt(std::max(m4 - m2 * m2, 1e-300) / n);
+	const bool ok = std::abs(z_mean) < bound && std::abs(z_var) < bound;
+	std::printf("%-6s %-24s mean %12.6g (z %5.2f)  variance %12.6g (z %5.2f)\n", ok ? "ok" : "FAIL", name, m, z_mean, m2, z_var);
+	return ok;
+}
+
+static bool check_gamma(rand_gen& rng, double alpha) {
+	std::vector<double> samples(200000);
+	for (double& x: samples)
+		x = rng.gamma_variate(alpha);
+	char name[64];
+	std::snprintf(name, sizeof(name), "gamma(%g)", alpha);
+	return check_moments(name, samples, alpha, alpha);
+}
+
+static bool check_beta(rand_gen& rng, double alpha, double beta) {
+	std::vector<double> samples(200000);
+	for (double& x: samples)
+		x = rng.beta_variate(alpha, beta);
+	const double sum = alpha + beta;
+	char name[64];
+	std::snprintf(name, sizeof(name), "beta(%g, %g)", alpha, beta);
+	return check_moments(name, samples, alpha / sum, alpha * beta / (sum * sum * (sum + 1.0)));
+}
+
+// Samples `n` pixels from a page where every third pixel is background, many times over, and checks that each pixel is
+// picked at most once per sample and that picks are spread evenly along the page
+// Pixels are numbered through their colour, so a sample says exactly which pixels it took
+static bool check_res_sample(rand_gen& rng, int n, int runs) {
+	constexpr int width = 1000, height = 600, buckets = 100;
+	struct image img = {0};
+	img.out_width = width;
+	img.out_height = height;
+	const size_t stride = mask_stride(width);
+	auto pixels = std::make_unique<unsigned char[]>((size_t)3 * width * height);
+	auto mask = std::make_unique<uint64_t[]>(stride * height);
+	std::vector<uint32_t> order((size_t)width * height, UINT32_MAX);
+	uint32_t foreground = 0;
+	for (size_t i = 0; i < (size_t)width * height; i++) {
+		pixels[3 * i] = (unsigned char)(i >> 16);
+		pixels[3 * i + 1] = (unsigned char)(i >> 8);
+		pixels[3 * i + 2] = (unsigned char)i;
+		const size_t y = i / width, x = i % width;
+		if (i % 3 == 0)
+			mask[y * stride + x / 64] |= (uint64_t)1 << (x % 64);
+		else
+			order[i] = foreground++;
+	}
+	for (size_t y = 0; y < (size_t)height; y++)
+		mask[y * stride + stride - 1] |= ~(uint64_t)0 << (width % 64);
+	img.data_dewarp = pixels.get();
+	img.data_mask = mask.get();
+
+	std::vector<uint64_t> counts(buckets);
+	std::vector<uint32_t> seen(foreground, UINT32_MAX);
+	std::vector<struct rgb> sample(n);
+	bool unique = true;
+	for (int run = 0; run < runs; run++) {
+		rand_gen local = rng.split();
+		res_sample(sample.data(), n, img, local);
+		for (const struct rgb& px: sample) {
+			const uint32_t index = order[((uint32_t)px.r << 16) | ((uint32_t)px.g << 8) | px.b];
+			if (index == UINT32_MAX || seen[index] == (uint32_t)run)
+				unique = false;
+			else {
+				seen[index] = (uint32_t)run;
+				counts[(uint64_t)index * buckets / foreground]++;
+			}
+		}
+	}
+	// Chi-squared with `buckets - 1` degrees of freedom, which has that mean and a variance of twice as much
+	double chi2 = 0.0;
+	const double expected = (double)n * runs / buckets;
+	for (uint64_t count: counts)
+		chi2 += (count - expected) * (count - expected) / expected;
+	const double z = (chi2 - (buckets - 1)) / std::sqrt(2.0 * (buckets - 1));
+	const bool ok = unique && z < bound;
+	char name[64];
+	std::snprintf(name, sizeof(name), "res_sample(%d) x %d", n, runs);
+	std::printf("%-6s %-24s chi-squared %8.2f (z %5.2f)%s\n", ok ? "ok" : "FAIL", name, chi2, z, unique ? "" : ", repeated or background pixels");
+	return ok;
+}
+
+int main(void) {
+	rand_gen rng(0x5eed);
+	bool ok = true;
+	for (double alpha: { 0.3, 1.0, 2.5, 10.0, 1000.0, 400000.0 })
+		ok &= check_gamma(rng, alpha);
+	// Including the shapes `res_sample` uses, a large sample size against a small skip
+	for (auto [alpha, beta]: { std::pair(0.5, 0.5), std::pair(2.0, 5.0), std::pair(400.0, 20.0), std::pair(400000.0, 1304.0) })
+		ok &= check_beta(rng, alpha, beta);
+	for (auto [n, runs]: { std::pair(1, 100000), std::pair(2, 100000), std::pair(50, 20000), std::pair(1000, 2000), std::pair(100000, 20) })
+		ok &= check_res_sample(rng, n, runs);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}